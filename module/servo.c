@@ -26,8 +26,33 @@
 #include <linux/uaccess.h>
 #include <linux/ioctl.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/bitmap.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/math64.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/cache.h>
+#include <linux/io_uring.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#endif
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/pwm.h>
+#include <linux/workqueue.h>
 #include <asm/atomic.h>
 
+#define CREATE_TRACE_POINTS
+#include "servo_trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("LikeSmith");
 MODULE_DESCRIPTION("A driver for generating PPM signals to control RC Servos.");
@@ -37,12 +62,73 @@ MODULE_VERSION("1.0:0");
 #define MIN_PERIOD 1000000
 #define MAX_PERIOD 2000000
 #define SERVO_PERIOD 20000000
+#define MAX_PHASE (SERVO_PERIOD - MAX_PERIOD)
+#define MIN_FRAME 2500000           // shortest per-servo frame, 400Hz
+#define MIN_LOW 250000              // shortest low time between pulses
+#define MAX_EDGES (2*(SERVO_PERIOD/MIN_FRAME) + 3)  // per servo per frame
+#define PPM_FRAME 22500000
+#define PPM_SEPARATOR 300000
+#define PPM_MIN_SYNC 3000000        // shortest gap marking the frame start
+#define PPM_CHANNELS 8
+
+// Output protocols
+#define PROTO_PWM 0                 // one pulse every frame
+#define PROTO_ONESHOT125 1          // 125-250us pulse after every setpoint
+#define PROTO_ONESHOT42 2           // 42-84us pulse after every setpoint
+#define PROTO_MULTISHOT 3           // 5-25us pulse after every setpoint
+#define PROTO_DSHOT150 4            // 16 bit digital frame at 150kbit/s
+#define PROTO_DSHOT300 5            // 16 bit digital frame at 300kbit/s
+#define N_PROTOS 6
+#define DSHOT_BITS 16
+#define DSHOT_STEPS (3*DSHOT_BITS)  // every bit rises, may fall early, falls
+#define SPIN_MARGIN_MIN 2000
+#define SPIN_MARGIN_MAX 50000
+#define SPIN_MARGIN_GUARD 1000
+#define SPIN_MARGIN_DECAY 6
+#define COMMIT_GUARD 100000         // headroom for a late commit timer
+#define URING_DEPTH 64              // io_uring commands queued per servo
+#define TRAJECTORY_LEN 256
+#define RECORD_MAGIC 0x42565253     // "SRVB", starts a binary write()
+#define RECORD_CHUNK 16
+#define HIST_BUCKETS 16
+#define HIST_SHIFT 10               // first histogram bucket ends at 1024ns
+#define MAX_TOLERANCE 50000
+// a servo timer fires up to margin plus slack before its edge and reads its
+// period there, the commit has to land before the earliest of them
+#define COMMIT_LEAD (SPIN_MARGIN_MAX + MAX_TOLERANCE + COMMIT_GUARD)
+
+// Interpolation toward a new setpoint
+#define INTERP_STEP 0               // jump to the target
+#define INTERP_LINEAR 1             // constant speed over interp_ns
+#define INTERP_EASE 2               // smoothstep over interp_ns
+#define N_INTERPS 3
+
+// Precision classes, how far each edge may move to share a timer expiry
+#define CLASS_EXACT 0               // edges fire on time
+#define CLASS_FINE 1
+#define CLASS_COARSE 2
+#define N_CLASSES 3
+
+// Setpoint sources, as reported by the servo_setpoint tracepoint
+#define SETPOINT_WRITE 0
+#define SETPOINT_IOCTL 1
+#define SETPOINT_SHM 2
+#define SETPOINT_COMMIT 3
+#define SETPOINT_TRAJECTORY 4
 
 // Flags
 #define SERVO_ENABLED 0
 #define SERVO_INVERTED 1
 #define SERVO_ACTIVE 2
 #define SERVO_OPEN 3
+#define SERVO_FLUSH 4
+#define SERVO_LIMITS 5
+#define SERVO_TRIGGER 6
+#define SERVO_STOPPED 7
+#define SERVO_PROTO_SHIFT 8         // output protocol, above the flags
+#define SERVO_PROTO_MASK (7UL << SERVO_PROTO_SHIFT)
+#define SERVO_CLASS_SHIFT 11        // precision class, above the protocol
+#define SERVO_CLASS_MASK (3UL << SERVO_CLASS_SHIFT)
 
 // IOCTL commands
 #define SERVO_ENB _IO('s',0)            // Enable servo
@@ -52,24 +138,388 @@ MODULE_VERSION("1.0:0");
 #define SERVO_RF  _IOR('s',4,uint32_t*) // Read flags
 #define SERVO_WV  _IOW('s',5,uint32_t*) // Write Value
 #define SERVO_RV  _IOW('s',6,uint32_t*) // Read Value
+#define SERVO_WP  _IOW('s',7,uint32_t*) // Write phase
+#define SERVO_RP  _IOR('s',8,uint32_t*) // Read phase
+#define SERVO_RL  _IOR('s',9,struct servo_lateness) // Read lateness
+#define SERVO_WC  _IOWR('s',10,struct servo_commit) // Write commit
+#define SERVO_WT  _IOWR('s',11,struct servo_trajectory) // Write trajectory
+#define SERVO_CT  _IO('s',12)           // Clear trajectory
+#define SERVO_WW  _IOW('s',13,uint32_t*) // Write wake lead
+#define SERVO_RW  _IOR('s',14,uint32_t*) // Read wake lead
+#define SERVO_RC  _IOR('s',15,struct servo_counters) // Read counters
+#define SERVO_WM  _IOW('s',16,struct servo_limits) // Write limits
+#define SERVO_RM  _IOR('s',17,struct servo_limits) // Read limits
+#define SERVO_WO  _IOW('s',18,uint32_t*) // Write output protocol
+#define SERVO_RO  _IOR('s',19,uint32_t*) // Read output protocol
+#define SERVO_WS  _IOW('s',20,struct servo_motion) // Write motion settings
+#define SERVO_RS  _IOR('s',21,struct servo_motion) // Read motion settings
+#define SERVO_WA  _IOW('s',22,uint32_t*) // Write precision class
+#define SERVO_RA  _IOR('s',23,uint32_t*) // Read precision class
+
+// Control device IOCTL commands
+#define SERVO_CTL_CLAIM _IOW('s',32,struct servo_mask)     // Claim servos
+#define SERVO_CTL_FREE  _IOW('s',33,struct servo_mask)     // Release servos
+#define SERVO_CTL_ENB   _IOW('s',34,struct servo_mask)     // Enable servos
+#define SERVO_CTL_DIS   _IOW('s',35,struct servo_mask)     // Disable servos
+#define SERVO_CTL_INV   _IOW('s',36,struct servo_mask)     // Invert outputs
+#define SERVO_CTL_WV    _IOW('s',37,struct servo_values)   // Write values
+#define SERVO_CTL_RV    _IOWR('s',38,struct servo_values)  // Read values
+
+// io_uring commands, the argument sits in the sqe command area
+#define SERVO_URING_WV  0   // Write value, uint32
+#define SERVO_URING_WF  1   // Write flags, uint32
+#define SERVO_URING_WC  2   // Write commit, struct servo_uring_commit
+#define SERVO_URING_RV  3   // Read value
+#define SERVO_URING_RF  4   // Read flags
+
+// Module parameters
+static bool consolidated = false;
+module_param(consolidated, bool, 0444);
+MODULE_PARM_DESC(consolidated, "Drive all servos from a single frame timer instead of one timer per servo.");
+static bool hard_irq = false;
+module_param(hard_irq, bool, 0444);
+MODULE_PARM_DESC(hard_irq, "Use absolute expiry timers that always run in hard interrupt context, even on PREEMPT_RT.");
+static bool pinned = false;
+module_param(pinned, bool, 0444);
+MODULE_PARM_DESC(pinned, "Pin servo timers to the cpu they were started on.");
+static bool precision = false;
+module_param(precision, bool, 0444);
+MODULE_PARM_DESC(precision, "Fire timers a calibrated margin early and busy-wait until the exact edge time.");
+static char *cpus;
+module_param(cpus, charp, 0444);
+MODULE_PARM_DESC(cpus, "List of cpus to run servo timers on, a single cpu takes all of them, several take servos in turn.");
+static unsigned int tolerance_ns[N_CLASSES] = {0, 1000, 5000};
+module_param_array(tolerance_ns, uint, NULL, 0444);
+MODULE_PARM_DESC(tolerance_ns, "Tolerance of each precision class in ns, edges may move by up to this much to share a timer expiry.");
+
+// Timer lateness, how long after the programmed expiry callbacks ran
+struct servo_lateness
+{
+    uint32_t last_ns;
+    uint32_t max_ns;
+    uint64_t total_ns;
+    uint64_t count;
+    uint64_t spin_ns;       // time spent busy-waiting for exact edges
+    uint32_t margin_ns;     // current early-fire margin
+    uint32_t cpu;           // cpu the last callback ran on, -1 before the first
+};
+
+// Setpoint for one servo within a commit
+struct servo_setpoint
+{
+    uint32_t idx;
+    uint32_t period_ns;
+};
+
+// Setpoints for several servos, applied together at the next frame boundary
+struct servo_commit
+{
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t setpoints;     // user pointer to count servo_setpoint entries
+    uint64_t frame;         // returns the frame the commit takes effect in
+};
+
+// Commit as carried in an io_uring sqe, the frame comes back in the cqe
+struct servo_uring_commit
+{
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t setpoints;     // user pointer to count servo_setpoint entries
+};
+
+// Frame period and pulse limits of one servo
+struct servo_limits
+{
+    uint32_t frame_ns;      // time from one pulse start to the next
+    uint32_t min_ns;        // shortest pulse
+    uint32_t max_ns;        // longest pulse
+    uint32_t gap_ns;        // shortest time between oneshot pulses
+};
+
+// How the applied pulse width follows the setpoint
+struct servo_motion
+{
+    uint32_t slew_ns;       // largest change from one pulse to the next, 0 for none
+    uint32_t interp;        // INTERP_STEP, INTERP_LINEAR or INTERP_EASE
+    uint32_t interp_ns;     // time taken to reach a new setpoint
+    uint32_t reserved;
+};
+
+// Timing histograms and counters shown in debugfs, each histogram bucket is
+// twice as wide as the one before it
+struct servo_hist
+{
+    u64 rise[HIST_BUCKETS];     // rising edge lateness
+    u64 fall[HIST_BUCKETS];     // falling edge lateness
+    u64 exec[HIST_BUCKETS];     // callback execution time
+    s64 err_min;                // pulse width error
+    s64 err_max;
+    s64 err_total;
+    u64 err_count;
+    u64 missed;                 // pulses started more than a pulse width late
+    u64 overruns;               // callbacks that ended after their next expiry
+    u64 coalesced;              // timer interrupts saved by edge tolerance
+    struct u64_stats_sync sync;
+};
+
+// Servos addressed by a control device ioctl, bit i selects servo i
+struct servo_mask
+{
+    uint32_t n_bits;
+    uint32_t reserved;
+    uint64_t bits;          // user pointer to (n_bits + 31)/32 uint32_t words
+};
+
+// Setpoints written or read through the control device
+struct servo_values
+{
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t setpoints;     // user pointer to count servo_setpoint entries
+};
+
+// Header of a binary write(), followed by count servo_setpoint records that
+// are applied immediately
+struct servo_records
+{
+    uint32_t magic;
+    uint32_t count;
+};
+
+// Rejected or adjusted input, as returned by SERVO_RC
+struct servo_counters
+{
+    uint32_t below_min;     // periods raised to the minimum
+    uint32_t above_max;     // periods lowered to the maximum
+    uint32_t phase_clamped; // phases lowered to the maximum
+    uint32_t bad_input;     // unparsable writes and records for unknown servos
+};
+
+// Trajectory point, applied at the first pulse starting at or after t_ns
+struct servo_point
+{
+    uint64_t t_ns;          // CLOCK_MONOTONIC time
+    uint32_t period_ns;
+    uint32_t reserved;
+};
+
+// Points to append to a servo's trajectory queue, in time order
+struct servo_trajectory
+{
+    uint32_t count;
+    uint32_t queued;        // returns how many points fit in the queue
+    uint64_t points;        // user pointer to count servo_point entries
+};
+
+// Scheduling state read and written for every pulse, packed into its own
+// cache line per servo. The state word holds the SERVO_* flags and the
+// output protocol.
+struct servo_hot
+{
+    unsigned long state;
+    atomic_t period_ns;
+    atomic_t phase_ns;
+    ktime_t t_start;
+    ktime_t t_fall;
+    uint32_t t_switch;
+    uint32_t t_next;
+    uint32_t t_phase;
+    uint32_t applied_ns;
+    uint32_t frame_ns;
+    uint32_t min_ns;
+    uint32_t max_ns;
+    uint32_t shm_seen;
+} ____cacheline_aligned;
+
+// Starts a timer on the cpu it is placed on
+struct servo_remote
+{
+    call_single_data_t csd;
+    struct hrtimer *timer;
+    ktime_t expires;
+    u64 slack;              // how long after expires the timer may run
+    int cpu;                // -1 to start on the calling cpu
+};
 
 // Variables
 struct servo_data
 {
+    struct servo_hot *hot;
     struct gpio_desc *gpio;
     struct hrtimer timer;
-    atomic_t period_ns;
-    unsigned int flags;
-    unsigned long t_switch;
-    unsigned long t_next;
+    raw_spinlock_t timer_lock;  // timer state against starts from outside it
+    struct servo_remote remote;
+    struct pwm_device *pwm;
+    struct delayed_work pwm_work;
+    unsigned long margin_ns;
+    struct servo_limits limits;
+    ktime_t t_edge;
+    ktime_t t_idle;
+    DECLARE_KFIFO_PTR(traj, struct servo_point);
+    struct mutex traj_lock;
+    struct hrtimer wake_timer;
+    wait_queue_head_t wait;
+    struct fasync_struct *fasync;
+    atomic_t wake_lead_ns;
+    atomic_t wake_seq;
+    unsigned int wake_seen;
+    atomic_t below_min;
+    atomic_t above_max;
+    atomic_t phase_clamped;
+    atomic_t bad_input;
+    atomic_t shm_maps;      // mappings of the shared page held by the owner
+    u64 uring_frame;        // frame of the last queued io_uring command
+    unsigned int uring_queued;
+    atomic_t slew_ns;
+    atomic_t interp;
+    atomic_t interp_ns;
+    unsigned long motion_from;
+    unsigned long motion_target;
+    ktime_t motion_t0;
     unsigned int idx;
+    struct servo_lateness lat;
+    struct u64_stats_sync lat_sync;
+    struct servo_hist hist;
+    ktime_t t_rise;
+};
+
+// Edge in the consolidated frame schedule
+struct servo_edge
+{
+    unsigned long t_ns;     // offset from frame start
+    unsigned long width;    // pulse width, for rising edges
+    unsigned int idx;       // servo the edge belongs to
+    unsigned int active;    // 1 if the edge starts the pulse, 0 if it ends it
+};
+
+// io_uring write held until the frame it is due in, the cqe then carries the
+// frame it took effect in
+struct servo_uring_entry
+{
+    struct list_head node;
+    struct io_uring_cmd *ioucmd;
+    struct servo_data *servo;
+    u64 frame;              // frame the command is due in
+    uint32_t op;
+    uint32_t value;         // value or flags for SERVO_URING_WV and WF
+    uint32_t count;
+    struct servo_setpoint *setpoints;   // setpoints for SERVO_URING_WC
+    int result;
+};
+
+// Lives in the io_uring_cmd pdu while the command is queued
+struct servo_uring_pdu
+{
+    struct servo_uring_entry *entry;
+};
+
+// Servos claimed through one open of the control device
+struct servo_client
+{
+    unsigned long *owned;
+    unsigned int shm_maps;  // mappings of the shared page, under shm_lock
+};
+
+// One half of the double-buffered commit
+struct servo_commit_buf
+{
+    unsigned long *mask;
+    uint32_t *period_ns;
 };
 
 static struct servo_data *servos;
+static struct servo_hot *servo_hot;
+static void *servo_hot_mem;
+static uint32_t *servo_shm;
+static struct gpio_descs *servo_gpios;
+static unsigned long *servo_values;
+static unsigned long *frame_values;
+static unsigned long *frame_pins;
+static struct gpio_desc **frame_desc;
+static unsigned int *frame_slot;
+static unsigned int n_frame_pins;
+static struct servo_edge *edges;
+static struct servo_edge *edges_new;
+static unsigned long *edges_dirty;
+static unsigned long *edges_rebuild;
+static atomic_t shm_maps;
+static unsigned int n_edges;
+static unsigned int edge_pos;
+static struct hrtimer frame_timer;
+static struct hrtimer commit_timer;
+static struct servo_hist frame_hist;
+static struct hrtimer ppm_timer;
+static bool ppm;
+static u32 ppm_frame_ns;
+static u32 ppm_separator_ns;
+static bool ppm_inverted;
+static unsigned long ppm_sync_ns;
+static unsigned int ppm_slot;
+static bool ppm_active;
+static ktime_t ppm_edge;
+static struct hrtimer dshot_timer;
+static struct gpio_desc **dshot_desc;
+static unsigned long *dshot_steps;
+static ktime_t dshot_idle;
+static bool dshot_stopped;
+static struct dentry *servo_debugfs;
+static struct cpumask servo_cpus;
+static struct servo_remote frame_remote;
+static struct servo_remote commit_remote;
+static struct servo_remote ppm_remote;
+static struct servo_remote dshot_remote;
+static struct servo_commit_buf commit_bufs[2];
+static unsigned int commit_staging;
+static bool commit_pending;
+static bool commit_stopped;
+static LIST_HEAD(uring_queue);
+static DEFINE_RAW_SPINLOCK(commit_lock);
+static DEFINE_RAW_SPINLOCK(limits_lock);
+static DEFINE_RAW_SPINLOCK(output_lock);
+static DEFINE_RAW_SPINLOCK(dshot_lock);
+static DEFINE_RAW_SPINLOCK(frame_lock);
+static bool frame_stopped;
+static bool frame_kick;
+static ktime_t frame_origin;
+static ktime_t frame_start;
+static unsigned long frame_margin_ns;
+static enum hrtimer_mode timer_mode;
 static dev_t servo_dev_first;
 static struct class *servo_class;
 static struct cdev servo_cdev;
-uint8_t n_servos = -1;
+static struct cdev servo_ctl_cdev;
+static unsigned long *servo_claimed;
+static DEFINE_MUTEX(ctl_lock);
+static DEFINE_SPINLOCK(shm_lock);
+unsigned int n_servos;
+static unsigned int n_gpio_servos;
+
+// Default limits of each output protocol, oneshot protocols repeat their last
+// pulse every frame so escs stay armed while no setpoints arrive
+static const struct servo_limits servo_protocols[N_PROTOS] =
+{
+    [PROTO_PWM] = {SERVO_PERIOD, MIN_PERIOD, MAX_PERIOD, 0},
+    [PROTO_ONESHOT125] = {MIN_FRAME, 125000, 250000, 25000},
+    [PROTO_ONESHOT42] = {MIN_FRAME, 42000, 84000, 10000},
+    [PROTO_MULTISHOT] = {MIN_FRAME, 5000, 25000, 5000},
+    [PROTO_DSHOT150] = {MIN_FRAME, 0, 4095, 5000},
+    [PROTO_DSHOT300] = {MIN_FRAME, 0, 4095, 5000},
+};
+
+// Bit period and high times of a 0 and a 1 bit for each dshot speed
+struct servo_dshot_timing
+{
+    unsigned long bit_ns;
+    unsigned long t0h_ns;
+    unsigned long t1h_ns;
+};
+
+static const struct servo_dshot_timing dshot_timings[] =
+{
+    {6667, 2500, 5000},     // DSHOT150
+    {3333, 1250, 2500},     // DSHOT300
+};
 struct device_node *dt_dev;
 
 // Get device ids
@@ -86,6 +536,99 @@ int servo_remove(struct platform_device  *pdev);
 
 // timer callback funcitons
 enum hrtimer_restart servo_cb(struct hrtimer *timer);
+enum hrtimer_restart servo_frame_cb(struct hrtimer *timer);
+enum hrtimer_restart servo_commit_cb(struct hrtimer *timer);
+enum hrtimer_restart servo_wake_cb(struct hrtimer *timer);
+enum hrtimer_restart servo_ppm_cb(struct hrtimer *timer);
+static enum hrtimer_restart servo_oneshot(struct servo_data *servo, ktime_t expires, ktime_t now);
+enum hrtimer_restart servo_dshot_cb(struct hrtimer *timer);
+
+// setpoint functions
+static unsigned long servo_next_period(struct servo_data *servo, ktime_t t_start);
+static unsigned long servo_next_start(struct servo_data *servo, unsigned long width);
+static unsigned long servo_motion(struct servo_data *servo, unsigned long target, ktime_t t_start);
+static uint32_t servo_clamp_period(struct servo_data *servo, uint32_t period_ns);
+static int servo_check_limits(const struct servo_limits *limits, unsigned int proto);
+static void servo_set_limits(struct servo_data *servo, const struct servo_limits *limits);
+static void servo_set_proto(struct servo_data *servo, unsigned int proto);
+static unsigned int servo_proto(const struct servo_hot *hot);
+static void servo_trigger(struct servo_data *servo);
+static void servo_enable(struct servo_data *servo, bool enable);
+static void servo_start(struct servo_data *servo);
+static void servo_stop(struct servo_data *servo);
+static bool servo_park(struct servo_data *servo);
+static void servo_set_period(struct servo_data *servo, uint32_t period_ns, int source);
+static ssize_t servo_write_records(struct servo_data *servo, const char __user *buf, size_t len);
+static long servo_queue_trajectory(struct servo_data *servo, struct servo_trajectory __user *arg);
+static int servo_alloc_commit(void);
+static void servo_free_commit(void);
+static long servo_stage_commit(struct servo_data *servo, struct servo_commit __user *arg);
+static long servo_stage_setpoints(struct servo_data *servo, uint32_t count, uint64_t user_setpoints, u64 *frame);
+static struct servo_setpoint *servo_copy_setpoints(uint32_t count, uint64_t user_setpoints);
+static bool servo_may_write(const struct servo_data *servo, unsigned int idx);
+static bool servo_may_write_all(const struct servo_data *servo, const struct servo_setpoint *setpoints, uint32_t count);
+static void servo_apply_commit(void);
+static void servo_commit_wake(void);
+static u64 servo_frame_index(ktime_t t);
+static u64 servo_effect_frame(struct servo_data *servo);
+static void servo_write_flags(struct servo_data *servo, uint32_t flags);
+static uint32_t servo_read_flags(struct servo_data *servo);
+
+// cpu placement functions
+static void servo_place_timer(struct servo_remote *remote, struct hrtimer *timer, int cpu);
+static void servo_start_timer(struct servo_remote *remote, ktime_t t, u64 slack);
+static void servo_remote_cb(void *info);
+
+// edge coalescing functions
+static unsigned int servo_precision(const struct servo_hot *hot);
+static void servo_set_precision(struct servo_data *servo, unsigned int class);
+static unsigned long servo_slack(const struct servo_hot *hot);
+static bool servo_arm_edge(struct servo_data *servo, unsigned long delay);
+static void servo_start_edge(struct servo_data *servo);
+
+// notification functions
+static void servo_arm_wake(struct servo_data *servo, ktime_t t_start);
+
+// consolidated scheduler functions
+static int servo_edge_cmp(const void *a, const void *b);
+static void servo_build_edges(void);
+static unsigned int servo_build_pulses(struct servo_data *servo, struct servo_edge *edge, ktime_t frame_end, bool *stable);
+static void servo_resched(struct servo_data *servo);
+static bool servo_fire_edge(const struct servo_edge *edge);
+static void servo_write_values(void);
+static void servo_frame_pins(void);
+static void servo_frame_wake(void);
+static bool servo_frame_idle(void);
+static void servo_drive(struct servo_data *servo, int active);
+
+// hardware pwm functions
+static void servo_pwm_work(struct work_struct *work);
+static void servo_pwm_update(struct servo_data *servo);
+static void servo_free_pwm(void);
+
+// ppm functions
+static bool servo_ppm_begin(void);
+
+// dshot functions
+static int servo_alloc_dshot(void);
+static void servo_free_dshot(void);
+static unsigned long servo_dshot_send(unsigned int proto, ktime_t now, unsigned long frame_ns);
+static u16 servo_dshot_packet(unsigned long setpoint);
+static void servo_dshot_trigger(struct servo_data *servo);
+
+// timing statistics functions
+static void servo_record_lateness(struct servo_data *servo, ktime_t expires, ktime_t now);
+static void servo_record_spin(struct servo_data *servo, u64 spin_ns, unsigned long margin_ns);
+static void servo_record_edge(struct servo_data *servo, int active, ktime_t due, ktime_t actual);
+static void servo_record_exec(struct servo_hist *hist, ktime_t start, ktime_t end, ktime_t next);
+static void servo_record_coalesced(struct servo_hist *hist);
+static unsigned int servo_hist_bucket(s64 ns);
+static void servo_init_debugfs(void);
+static int servo_stats_show(struct seq_file *seq, void *unused);
+
+// precision mode functions
+static unsigned long servo_calibrate_margin(unsigned long margin_ns, ktime_t expires, ktime_t now);
+static u64 servo_spin_until(ktime_t t);
 
 // device file callback functions
 int servo_open(struct inode *inode, struct file *file);
@@ -93,6 +636,36 @@ int servo_release(struct inode *inode, struct file *file);
 ssize_t servo_read(struct file *file, char __user *buf, size_t len, loff_t *off);
 ssize_t servo_write(struct file *file, const char __user *buf, size_t len, loff_t *off);
 long servo_ioctl(struct file *file, unsigned int, unsigned long);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+int servo_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+static int servo_uring_queue(struct servo_data *servo, struct io_uring_cmd *ioucmd, const void *arg, unsigned int issue_flags);
+static void servo_uring_apply(u64 frame);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+static void servo_uring_done(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+#else
+static void servo_uring_done(struct io_uring_cmd *ioucmd);
+#endif
+#endif
+int servo_mmap(struct file *file, struct vm_area_struct *vma);
+static void servo_shm_open(struct vm_area_struct *vma);
+static void servo_shm_close(struct vm_area_struct *vma);
+static int servo_map_shm(struct vm_area_struct *vma, const struct vm_operations_struct *ops);
+static void servo_shm_cover(struct servo_data *servo, int maps);
+__poll_t servo_poll(struct file *file, poll_table *wait);
+int servo_fasync(int fd, struct file *file, int on);
+
+// control device callback functions
+int servo_ctl_open(struct inode *inode, struct file *file);
+int servo_ctl_release(struct inode *inode, struct file *file);
+long servo_ctl_ioctl(struct file *file, unsigned int, unsigned long);
+static long servo_ctl_mask(struct servo_mask __user *arg, unsigned long *mask);
+static long servo_ctl_values(struct servo_client *client, struct servo_values __user *arg, bool write);
+int servo_ctl_mmap(struct file *filp, struct vm_area_struct *vma);
+static void servo_ctl_shm_open(struct vm_area_struct *vma);
+static void servo_ctl_shm_close(struct vm_area_struct *vma);
+static void servo_ctl_shm_cover(const unsigned long *mask, int maps);
+
+DEFINE_SHOW_ATTRIBUTE(servo_stats);
 
 // device file operations
 static struct file_operations servo_fops =
@@ -103,6 +676,36 @@ static struct file_operations servo_fops =
     .open = servo_open,
     .release = servo_release,
     .unlocked_ioctl = servo_ioctl,
+    .mmap = servo_mmap,
+    .poll = servo_poll,
+    .fasync = servo_fasync,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    .uring_cmd = servo_uring_cmd,
+#endif
+};
+
+// shared setpoint page operations
+static const struct vm_operations_struct servo_shm_ops =
+{
+    .open = servo_shm_open,
+    .close = servo_shm_close,
+};
+
+// shared setpoint page operations for control device mappings
+static const struct vm_operations_struct servo_ctl_shm_ops =
+{
+    .open = servo_ctl_shm_open,
+    .close = servo_ctl_shm_close,
+};
+
+// control device file operations
+static struct file_operations servo_ctl_fops =
+{
+    .owner = THIS_MODULE,
+    .open = servo_ctl_open,
+    .release = servo_ctl_release,
+    .unlocked_ioctl = servo_ctl_ioctl,
+    .mmap = servo_ctl_mmap,
 };
 
 // platform driver
@@ -122,9 +725,15 @@ module_platform_driver(servo_driver);
 int servo_probe(struct platform_device *pdev)
 {
     unsigned int i;
-    struct property *prop;
-    char n_servos_str[4];
-    n_servos_str[0] = '\0';
+    u32 phase;
+    bool spread;
+    struct servo_limits limits;
+    u32 proto;
+    u32 value;
+    int count;
+    unsigned int cpu = -1;
+    const char *name;
+    ktime_t t0;
 
     pr_info("servos: [INFO] Starting servo driver...\n");
 
@@ -134,20 +743,42 @@ int servo_probe(struct platform_device *pdev)
         return -1;
     }
 
-    prop = dt_dev->properties;
+    // in ppm mode every servo is a channel of one pulse train on the first gpio
+    ppm = of_property_read_bool(dt_dev, "servo-ppm");
+    ppm_frame_ns = PPM_FRAME;
+    ppm_separator_ns = PPM_SEPARATOR;
+    of_property_read_u32(dt_dev, "ppm-frame-ns", &ppm_frame_ns);
+    of_property_read_u32(dt_dev, "ppm-separator-ns", &ppm_separator_ns);
+    ppm_inverted = of_property_read_bool(dt_dev, "ppm-inverted");
+    if (ppm && (ppm_separator_ns == 0 || ppm_separator_ns >= MIN_PERIOD))
+    {
+        pr_warn("servos: [WARN] PPM separator of %dns is invalid, using %dns.\n", ppm_separator_ns, PPM_SEPARATOR);
+        ppm_separator_ns = PPM_SEPARATOR;
+    }
 
-    while (prop)
+    // one servo per gpio followed by one per hardware pwm, or as many ppm
+    // channels as the dt asks for
+    if (ppm)
     {
-        if (!strcmp(prop->name, "n-servos"))
+        n_servos = PPM_CHANNELS;
+        of_property_read_u32(dt_dev, "ppm-channels", &n_servos);
+        n_gpio_servos = n_servos;
+
+        // the frame has to fit every channel at its shortest plus the sync gap
+        if (ppm_frame_ns < PPM_MIN_SYNC + (u64)n_servos*MIN_PERIOD)
         {
-            strncpy(n_servos_str, prop->value, 3);
-            n_servos_str[3] = '\0';
-            break;
+            pr_warn("servos: [WARN] PPM frame of %dns is too short for %d channels, using %dns.\n", ppm_frame_ns, n_servos, PPM_FRAME);
+            ppm_frame_ns = PPM_FRAME;
         }
-        prop = prop->next;
     }
-
-    if (kstrtou8(n_servos_str, 10, &n_servos))
+    else
+    {
+        count = gpiod_count(&(pdev->dev), "servo");
+        n_gpio_servos = count > 0 ? count : 0;
+        count = of_count_phandle_with_args(dt_dev, "pwms", "#pwm-cells");
+        n_servos = n_gpio_servos + (count > 0 ? count : 0);
+    }
+    if (n_servos == 0 || n_servos > MINORMASK)
     {
         pr_err("servos: [FATAL] Could not determine number of servos in system\n");
         goto nservo_fail;
@@ -155,42 +786,343 @@ int servo_probe(struct platform_device *pdev)
 
     pr_info("servos: [INFO] system has %d servos.\n", n_servos);
 
-    if ((servos = kmalloc(sizeof(struct servo_data)*n_servos, GFP_KERNEL)) == NULL)
+    if ((servos = kvcalloc(n_servos, sizeof(struct servo_data), GFP_KERNEL)) == NULL)
     {
         pr_err("servos: [FATAL] Could not allocate memory for servos");
         goto nservo_fail;
     }
 
-    // get device major/minor numbers
-    if ((i = alloc_chrdev_region(&servo_dev_first, 0, n_servos, "servos")) < 0)
+    // hot state gets a cache line per servo, kmalloc only guarantees that
+    // alignment for power of two sizes
+    if ((servo_hot_mem = kzalloc(sizeof(struct servo_hot)*(n_servos + 1), GFP_KERNEL)) == NULL)
+    {
+        pr_err("servos: [FATAL] Could not allocate memory for servo state");
+        goto hot_fail;
+    }
+    servo_hot = PTR_ALIGN(servo_hot_mem, SMP_CACHE_BYTES);
+    for (i = 0; i < n_servos; i++)
+    {
+        servos[i].hot = &(servo_hot[i]);
+    }
+
+    // servos with short frames contribute several pulses to each frame, the
+    // second half holds the edges of servos being rescheduled
+    if ((edges = kvmalloc_array(2*MAX_EDGES*n_servos, sizeof(struct servo_edge), GFP_KERNEL)) == NULL)
+    {
+        pr_err("servos: [FATAL] Could not allocate memory for edge schedule");
+        goto edges_fail;
+    }
+    edges_new = edges + MAX_EDGES*n_servos;
+    n_edges = 0;
+    edge_pos = 0;
+    if ((edges_dirty = bitmap_zalloc(2*BITS_TO_LONGS(n_servos)*BITS_PER_LONG, GFP_KERNEL)) == NULL)
+    {
+        pr_err("servos: [FATAL] Could not allocate memory for edge schedule");
+        goto dirty_fail;
+    }
+    edges_rebuild = edges_dirty + BITS_TO_LONGS(n_servos);
+    bitmap_fill(edges_dirty, n_servos);
+    atomic_set(&shm_maps, 0);
+
+    // shared setpoint page, one word per servo, mappable from any servo file
+    // and the control device
+    if ((servo_shm = vmalloc_user(PAGE_ALIGN(sizeof(uint32_t)*n_servos))) == NULL)
+    {
+        pr_err("servos: [FATAL] Could not allocate memory for shared setpoints");
+        goto shm_fail;
+    }
+
+    if (servo_alloc_commit())
+    {
+        pr_err("servos: [FATAL] Could not allocate memory for commit buffers");
+        goto commit_fail;
+    }
+
+    if (servo_alloc_dshot())
+    {
+        pr_err("servos: [FATAL] Could not allocate memory for dshot frames");
+        goto dshot_fail;
+    }
+
+    frame_margin_ns = precision ? SPIN_MARGIN_MAX : 0;
+    memset(&frame_hist, 0, sizeof(struct servo_hist));
+    u64_stats_init(&(frame_hist.sync));
+
+    // the frame timer always uses absolute expiry, servo timers only when
+    // running in hard interrupt context
+    timer_mode = hard_irq ? HRTIMER_MODE_ABS_HARD : HRTIMER_MODE_REL;
+    if (pinned)
+    {
+        timer_mode |= HRTIMER_MODE_PINNED;
+    }
+
+    // timers may be placed on the cpus from the module parameter or the dt,
+    // they stay pinned there once started
+    cpumask_clear(&servo_cpus);
+    if (cpus != NULL && *cpus != '\0')
+    {
+        if (cpulist_parse(cpus, &servo_cpus))
+        {
+            pr_warn("servos: [WARN] Could not parse cpu list %s, timers are not placed.\n", cpus);
+            cpumask_clear(&servo_cpus);
+        }
+    }
+    else
+    {
+        count = of_property_count_u32_elems(dt_dev, "servo-cpus");
+        for (i = 0; (int)i < count; i++)
+        {
+            if (!of_property_read_u32_index(dt_dev, "servo-cpus", i, &value) && value < nr_cpu_ids)
+            {
+                cpumask_set_cpu(value, &servo_cpus);
+            }
+        }
+    }
+    cpumask_and(&servo_cpus, &servo_cpus, cpu_online_mask);
+    if (!cpumask_empty(&servo_cpus))
+    {
+        timer_mode |= HRTIMER_MODE_PINNED;
+        pr_info("servos: [INFO] Placing servo timers on cpus %*pbl.\n", cpumask_pr_args(&servo_cpus));
+    }
+
+    // edges of tolerant servos may move to share timer expiries
+    for (i = 0; i < N_CLASSES; i++)
+    {
+        if (tolerance_ns[i] > MAX_TOLERANCE)
+        {
+            pr_warn("servos: [WARN] Tolerance of %dns for precision class %d is above maximum of %dns, using maximum.\n", tolerance_ns[i], i, MAX_TOLERANCE);
+            tolerance_ns[i] = MAX_TOLERANCE;
+        }
+    }
+    hrtimer_init(&frame_timer, CLOCK_MONOTONIC, timer_mode & ~HRTIMER_MODE_REL);
+    frame_timer.function = &servo_frame_cb;
+    hrtimer_init(&commit_timer, CLOCK_MONOTONIC, timer_mode & ~HRTIMER_MODE_REL);
+    commit_timer.function = &servo_commit_cb;
+    commit_stopped = true;
+    hrtimer_init(&ppm_timer, CLOCK_MONOTONIC, timer_mode & ~HRTIMER_MODE_REL);
+    ppm_timer.function = &servo_ppm_cb;
+    hrtimer_init(&dshot_timer, CLOCK_MONOTONIC, timer_mode & ~HRTIMER_MODE_REL);
+    dshot_timer.function = &servo_dshot_cb;
+    dshot_idle = 0;
+    dshot_stopped = true;
+
+    // the shared timers all go on the first cpu
+    count = cpumask_empty(&servo_cpus) ? -1 : (int)cpumask_first(&servo_cpus);
+    servo_place_timer(&frame_remote, &frame_timer, count);
+    servo_place_timer(&commit_remote, &commit_timer, count);
+    servo_place_timer(&ppm_remote, &ppm_timer, count);
+    servo_place_timer(&dshot_remote, &dshot_timer, count);
+
+    // get device major/minor numbers, the control device follows the servos
+    if (alloc_chrdev_region(&servo_dev_first, 0, n_servos + 1, "servos") < 0)
     {
         pr_err("servos: [FATAL] Could not allocate major number\n");
-        return -1;
+        goto chrdev_fail;
     }
 
     pr_info("servos: [INFO] Servos got character device %d:%d-%d\n", MAJOR(servo_dev_first), MINOR(servo_dev_first), MINOR(servo_dev_first)+n_servos-1);
 
-    // acquire gpio pins, setup servos
+    // acquire gpio pins as one array so edges can be written together, a
+    // board may drive all its servos from hardware pwm instead
+    if (IS_ERR(servo_gpios = gpiod_get_array_optional(&(pdev->dev), "servo", GPIOD_OUT_HIGH)))
+    {
+        pr_err("servos: [FATAL] Could not lock gpios for servos.\n");
+        goto array_fail;
+    }
+    if ((servo_gpios ? servo_gpios->ndescs : 0) < (ppm ? 1 : n_gpio_servos))
+    {
+        pr_err("servos: [FATAL] Only %d gpios available for %d servos.\n", servo_gpios ? servo_gpios->ndescs : 0, n_gpio_servos);
+        goto values_fail;
+    }
+    if ((servo_values = bitmap_zalloc(3*BITS_TO_LONGS(n_servos)*BITS_PER_LONG, GFP_KERNEL)) == NULL)
+    {
+        pr_err("servos: [FATAL] Could not allocate memory for gpio values.\n");
+        goto values_fail;
+    }
+    frame_values = servo_values + BITS_TO_LONGS(n_servos);
+    frame_pins = frame_values + BITS_TO_LONGS(n_servos);
+    bitmap_fill(servo_values, n_servos);
+
+    // the frame timer only writes the pins of its own servos, the first
+    // frame collects them
+    frame_desc = kcalloc(n_servos, sizeof(struct gpio_desc *), GFP_KERNEL);
+    frame_slot = kmalloc_array(n_servos, sizeof(unsigned int), GFP_KERNEL);
+    if (frame_desc == NULL || frame_slot == NULL)
+    {
+        pr_err("servos: [FATAL] Could not allocate memory for frame pins.\n");
+        goto frame_fail;
+    }
+    memset(frame_slot, 0xff, n_servos*sizeof(unsigned int));
+    n_frame_pins = 0;
+    if ((servo_claimed = bitmap_zalloc(n_servos, GFP_KERNEL)) == NULL)
+    {
+        pr_err("servos: [FATAL] Could not allocate memory for servo claims.\n");
+        goto claimed_fail;
+    }
+
+    // servos past the gpios each take the pwm named at the same position
+    for (i = n_gpio_servos; i < n_servos; i++)
+    {
+        if (of_property_read_string_index(dt_dev, "pwm-names", i - n_gpio_servos, &name) || IS_ERR(servos[i].pwm = pwm_get(&(pdev->dev), name)))
+        {
+            pr_err("servos: [FATAL] Could not get pwm for servo %d.\n", i);
+            servos[i].pwm = NULL;
+            goto pwm_fail;
+        }
+        INIT_DELAYED_WORK(&(servos[i].pwm_work), servo_pwm_work);
+    }
+
+    // trajectory queues
+    for (i = 0; i < n_servos; i++)
+    {
+        if (kfifo_alloc(&(servos[i].traj), TRAJECTORY_LEN, GFP_KERNEL))
+        {
+            pr_err("servos: [FATAL] Could not allocate trajectory queue for servo %d.\n", i);
+            while (i-- > 0)
+            {
+                kfifo_free(&(servos[i].traj));
+            }
+            goto traj_fail;
+        }
+        mutex_init(&(servos[i].traj_lock));
+        raw_spin_lock_init(&(servos[i].timer_lock));
+    }
+
+    // phases either come from the dt or are spread evenly across the frame
+    spread = of_property_read_bool(dt_dev, "servo-phase-spread");
+
+    // all servos share a frame grid starting here
+    t0 = ktime_add_ns(ktime_get(), MIN_PERIOD);
+    frame_origin = t0;
+
+    // setup servos
     for (i = 0; i < n_servos; i++)
     {
-        if (IS_ERR(servos[i].gpio = gpiod_get_index(&(pdev->dev), "servo", i, GPIOD_OUT_HIGH)))
+        servos[i].gpio = i < n_gpio_servos ? servo_gpios->desc[ppm ? 0 : i] : NULL;
+
+        // frame period and pulse limits default to those of the protocol
+        if (of_property_read_u32_index(dt_dev, "servo-protocols", i, &proto))
+        {
+            proto = PROTO_PWM;
+        }
+        if (proto >= N_PROTOS || ((ppm || servos[i].pwm) && proto != PROTO_PWM))
+        {
+            pr_warn("servos: [WARN] Protocol %d is not available for servo %d, using pwm.\n", proto, i);
+            proto = PROTO_PWM;
+        }
+        limits = servo_protocols[proto];
+        of_property_read_u32_index(dt_dev, "servo-frame-ns", i, &(limits.frame_ns));
+        of_property_read_u32_index(dt_dev, "servo-min-ns", i, &(limits.min_ns));
+        of_property_read_u32_index(dt_dev, "servo-max-ns", i, &(limits.max_ns));
+        of_property_read_u32_index(dt_dev, "servo-gap-ns", i, &(limits.gap_ns));
+        if (servo_check_limits(&limits, proto))
+        {
+            pr_warn("servos: [WARN] Invalid frame of %dns and limits of %d-%dns for servo %d, using defaults.\n", limits.frame_ns, limits.min_ns, limits.max_ns, i);
+            limits = servo_protocols[proto];
+        }
+        servos[i].limits = limits;
+        servos[i].hot->frame_ns = limits.frame_ns;
+        servos[i].hot->min_ns = limits.min_ns;
+        servos[i].hot->max_ns = limits.max_ns;
+
+        if (spread)
         {
-            pr_err("servos: [FATAL] Could not lock gpio for servo %d.\n", i);
-            goto gpio_fail;
+            phase = (limits.frame_ns - limits.max_ns) / n_servos * i;
+        }
+        else if (of_property_read_u32_index(dt_dev, "servo-phases", i, &phase))
+        {
+            phase = 0;
+        }
+        if (phase > limits.frame_ns - limits.max_ns)
+        {
+            pr_warn("servos: [WARN] Phase of %dns for servo %d is above maximum phase of %dns, using maximum.\n", phase, i, limits.frame_ns - limits.max_ns);
+            phase = limits.frame_ns - limits.max_ns;
         }
 
-        atomic_set(&(servos[i].period_ns), MIN_PERIOD);
-        servos[i].flags = 0;
+        atomic_set(&(servos[i].hot->period_ns), limits.min_ns);
+        atomic_set(&(servos[i].hot->phase_ns), phase);
+        servos[i].hot->t_phase = phase;
+        servos[i].hot->t_start = 0;
+        servos[i].hot->t_fall = 0;
+        servos[i].t_idle = 0;
+        servos[i].margin_ns = precision ? SPIN_MARGIN_MAX : 0;
+        servos[i].hot->shm_seen = 0;
+        servos[i].hot->state = (unsigned long)proto << SERVO_PROTO_SHIFT;
+
+        // edges fire on time unless the dt puts the servo in a looser class
+        value = CLASS_EXACT;
+        of_property_read_u32_index(dt_dev, "servo-classes", i, &value);
+        servos[i].hot->state |= (unsigned long)(value < N_CLASSES ? value : CLASS_EXACT) << SERVO_CLASS_SHIFT;
         servos[i].idx = i;
-        hrtimer_init(&(servos[i].timer), CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        memset(&(servos[i].lat), 0, sizeof(struct servo_lateness));
+        u64_stats_init(&(servos[i].lat_sync));
+        memset(&(servos[i].hist), 0, sizeof(struct servo_hist));
+        u64_stats_init(&(servos[i].hist.sync));
+        servos[i].t_rise = 0;
+        init_waitqueue_head(&(servos[i].wait));
+        servos[i].fasync = NULL;
+        atomic_set(&(servos[i].wake_lead_ns), 0);
+        atomic_set(&(servos[i].wake_seq), 0);
+        servos[i].wake_seen = 0;
+        atomic_set(&(servos[i].below_min), 0);
+        atomic_set(&(servos[i].above_max), 0);
+        atomic_set(&(servos[i].phase_clamped), 0);
+        atomic_set(&(servos[i].bad_input), 0);
+        atomic_set(&(servos[i].shm_maps), 0);
+
+        // setpoints take effect in a single step unless the dt asks otherwise
+        value = 0;
+        of_property_read_u32_index(dt_dev, "servo-slew-ns", i, &value);
+        atomic_set(&(servos[i].slew_ns), value);
+        value = INTERP_STEP;
+        of_property_read_u32_index(dt_dev, "servo-interp", i, &value);
+        atomic_set(&(servos[i].interp), value < N_INTERPS ? value : INTERP_STEP);
+        value = 0;
+        of_property_read_u32_index(dt_dev, "servo-interp-ns", i, &value);
+        atomic_set(&(servos[i].interp_ns), value);
+        servos[i].hot->applied_ns = limits.min_ns;
+        servos[i].motion_from = limits.min_ns;
+        servos[i].motion_target = limits.min_ns;
+        servos[i].motion_t0 = 0;
+        hrtimer_init(&(servos[i].wake_timer), CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+        servos[i].wake_timer.function = &servo_wake_cb;
+        hrtimer_init(&(servos[i].timer), CLOCK_MONOTONIC, timer_mode);
         servos[i].timer.function = &servo_cb;
-        hrtimer_start(&(servos[i].timer), ktime_set(0, MIN_PERIOD), HRTIMER_MODE_REL);
+        servos[i].lat.cpu = U32_MAX;
+
+        // servo timers take the placement cpus in turn
+        if (!cpumask_empty(&servo_cpus))
+        {
+            cpu = cpumask_next(cpu, &servo_cpus);
+            if (cpu >= nr_cpu_ids)
+            {
+                cpu = cpumask_first(&servo_cpus);
+            }
+        }
+        servo_place_timer(&(servos[i].remote), &(servos[i].timer), cpumask_empty(&servo_cpus) ? -1 : (int)cpu);
+
+        // servo timers only run while their servo is enabled
+        set_bit(SERVO_STOPPED, &(servos[i].hot->state));
+
+        pr_debug("servos: [DEBUG] Servo %d setup.\n", i);
+    }
 
-        pr_info("servos: [INFO] Servo %d setup.\n", i);
+    // the frame or ppm timer starts with the first enabled servo
+    frame_stopped = true;
+    frame_kick = false;
+    if (ppm)
+    {
+        gpiod_set_value(servo_gpios->desc[0], ppm_inverted);
+        pr_info("servos: [INFO] Using ppm output with %d channels.\n", n_servos);
+    }
+    else if (consolidated)
+    {
+        pr_info("servos: [INFO] Using consolidated frame scheduler.\n");
     }
 
     // setup servo devices
     cdev_init(&servo_cdev, &servo_fops);
+    cdev_init(&servo_ctl_cdev, &servo_ctl_fops);
     if (IS_ERR(servo_class = class_create(THIS_MODULE, "servo_class")))
     {
         pr_err("servos: [FATAL] Could not create class.\n");
@@ -210,31 +1142,76 @@ int servo_probe(struct platform_device *pdev)
             goto device_fail;
         }
 
-        pr_info("servos: [INFO] Created dev file for servo %d", i);
+        pr_debug("servos: [DEBUG] Created dev file for servo %d.\n", i);
+    }
+    if (cdev_add(&servo_ctl_cdev, MKDEV(MAJOR(servo_dev_first), n_servos), 1) < 0)
+    {
+        pr_err("servos: [FATAL] Could not add control device to cdev");
+        goto device_fail;
+    }
+    if (IS_ERR(device_create(servo_class, &(pdev->dev), MKDEV(MAJOR(servo_dev_first), n_servos), NULL, "servo_ctl")))
+    {
+        pr_err("servos: [FATAL] Failed to create device servo_ctl\n");
+        goto device_fail;
     }
 
+    servo_init_debugfs();
+
     pr_info("servos: [INFO] Servos module successfully probed.\n");
     return 0;
 
     // Cleanup in case of failure
 device_fail:
-    for (i = 0; i < n_servos; i++)
+    for (i = 0; i <= n_servos; i++)
     {
         dev_t dev = MKDEV(MAJOR(servo_dev_first), i);
         device_destroy(servo_class, dev);
     }
     class_destroy(servo_class);
 class_fail:
+    cdev_del(&servo_ctl_cdev);
     cdev_del(&servo_cdev);
-gpio_fail:
+    hrtimer_cancel(&frame_timer);
+    hrtimer_cancel(&commit_timer);
+    hrtimer_cancel(&ppm_timer);
+    hrtimer_cancel(&dshot_timer);
     for (i = 0; i < n_servos; i++)
     {
         hrtimer_cancel(&(servos[i].timer));
+        hrtimer_cancel(&(servos[i].wake_timer));
         gpiod_set_value(servos[i].gpio, 0);
-        gpiod_put(servos[i].gpio);
+        kfifo_free(&(servos[i].traj));
+    }
+traj_fail:
+pwm_fail:
+    servo_free_pwm();
+    bitmap_free(servo_claimed);
+claimed_fail:
+frame_fail:
+    kfree(frame_slot);
+    kfree(frame_desc);
+    bitmap_free(servo_values);
+values_fail:
+    if (servo_gpios)
+    {
+        gpiod_put_array(servo_gpios);
     }
-    unregister_chrdev_region(servo_dev_first, n_servos);
-    kfree(servos);
+array_fail:
+    unregister_chrdev_region(servo_dev_first, n_servos + 1);
+chrdev_fail:
+    servo_free_dshot();
+dshot_fail:
+    servo_free_commit();
+commit_fail:
+    vfree(servo_shm);
+shm_fail:
+    bitmap_free(edges_dirty);
+dirty_fail:
+    kvfree(edges);
+edges_fail:
+    kfree(servo_hot_mem);
+hot_fail:
+    kvfree(servos);
 nservo_fail:
     of_node_put(dt_dev);
     return -1;
@@ -242,20 +1219,43 @@ nservo_fail:
 
 int servo_remove(struct platform_device *pdev)
 {
-    unsigned char i;
+    unsigned int i;
 
+    debugfs_remove_recursive(servo_debugfs);
+    hrtimer_cancel(&frame_timer);
+    hrtimer_cancel(&commit_timer);
+    hrtimer_cancel(&ppm_timer);
+    hrtimer_cancel(&dshot_timer);
     for (i = 0; i < n_servos; i++)
     {
         dev_t dev = MKDEV(MAJOR(servo_dev_first), i);
         device_destroy(servo_class, dev);
         hrtimer_cancel(&(servos[i].timer));
+        hrtimer_cancel(&(servos[i].wake_timer));
         gpiod_set_value(servos[i].gpio, 0);
-        gpiod_put(servos[i].gpio);
+        kfifo_free(&(servos[i].traj));
     }
+    device_destroy(servo_class, MKDEV(MAJOR(servo_dev_first), n_servos));
     class_destroy(servo_class);
+    cdev_del(&servo_ctl_cdev);
     cdev_del(&servo_cdev);
-    unregister_chrdev_region(servo_dev_first, n_servos);
-    kfree(servos);
+    servo_free_pwm();
+    bitmap_free(servo_claimed);
+    kfree(frame_slot);
+    kfree(frame_desc);
+    bitmap_free(servo_values);
+    if (servo_gpios)
+    {
+        gpiod_put_array(servo_gpios);
+    }
+    unregister_chrdev_region(servo_dev_first, n_servos + 1);
+    servo_free_dshot();
+    servo_free_commit();
+    vfree(servo_shm);
+    bitmap_free(edges_dirty);
+    kvfree(edges);
+    kfree(servo_hot_mem);
+    kvfree(servos);
     of_node_put(dt_dev);
 
     pr_info("servos: [INFO] Servos module successfully removed.\n");
@@ -266,214 +1266,2874 @@ int servo_remove(struct platform_device *pdev)
 enum hrtimer_restart servo_cb(struct hrtimer *timer)
 {
     struct servo_data *servo = container_of(timer, struct servo_data, timer);
+    struct servo_hot *hot = servo->hot;
+    unsigned long state = READ_ONCE(hot->state);
+    ktime_t expires = hrtimer_get_expires(timer);
+    ktime_t now = hrtimer_cb_get_time(timer);
+    enum hrtimer_restart restart;
+    ktime_t actual;
+    unsigned long flags;
+    unsigned long delay;
+    int active;
+
+    servo_record_lateness(servo, expires, now);
+
+    // running ahead of the hard expiry means another interrupt took us along
+    if (ktime_before(now, expires))
+    {
+        servo_record_coalesced(&(servo->hist));
+    }
+
+    // with the frame timer driving pwm, servo timers only run oneshot pulses
+    if ((state & SERVO_PROTO_MASK) || consolidated)
+    {
+        return servo_oneshot(servo, expires, now);
+    }
 
-    if (test_bit(SERVO_ENABLED, (void *) &(servo->flags)))
+    if (state & BIT(SERVO_ENABLED))
     {
-        if (test_bit(SERVO_ACTIVE, (void *) &(servo->flags)))
+        // the timer fired margin_ns early, wait out the rest of it
+        if (precision)
+        {
+            servo->margin_ns = servo_calibrate_margin(servo->margin_ns, expires, now);
+            servo_record_spin(servo, servo_spin_until(ktime_sub_ns(servo->t_edge, servo_slack(hot))), servo->margin_ns);
+        }
+
+        // every expiry flips the output, the inversion flips the level
+        active = !(state & BIT(SERVO_ACTIVE));
+        gpiod_set_value(servo->gpio, active ^ !!(state & BIT(SERVO_INVERTED)));
+        actual = ktime_get();
+        trace_servo_edge(servo->idx, active, ktime_to_ns(servo->t_edge), ktime_to_ns(actual));
+        change_bit(SERVO_ACTIVE, &(hot->state));
+
+        if (!active)
         {
-            gpiod_set_value(servo->gpio, test_bit(SERVO_INVERTED, (void *) &(servo->flags)));
-            clear_bit(SERVO_ACTIVE, (void *) &(servo->flags));
-            hrtimer_add_expires_ns(timer, servo->t_next);
+            servo_record_edge(servo, 0, servo->t_edge, actual);
+            delay = hot->t_next;
         }
         else
         {
-            gpiod_set_value(servo->gpio, !test_bit(SERVO_INVERTED, (void *) &(servo->flags)));
-            set_bit(SERVO_ACTIVE, (void *) &(servo->flags));
+            hot->t_switch = servo_next_period(servo, servo->t_edge);
+            hot->t_next = servo_next_start(servo, hot->t_switch) - hot->t_switch;
+            delay = hot->t_switch;
+            servo_record_edge(servo, 1, servo->t_edge, actual);
 
-            servo->t_switch = atomic_read(&(servo->period_ns));
-            servo->t_next = SERVO_PERIOD - servo->t_switch;
-            hrtimer_add_expires_ns(timer, servo->t_switch);
+            servo_arm_wake(servo, ktime_add_ns(servo->t_edge, hot->t_switch + hot->t_next));
         }
     }
     else
     {
-        hrtimer_add_expires_ns(timer, SERVO_PERIOD);
+        // a disabled servo ends its pulse and then stops until re-enabled
+        delay = hot->frame_ns;
+        if (state & BIT(SERVO_ACTIVE))
+        {
+            gpiod_set_value(servo->gpio, !!(state & BIT(SERVO_INVERTED)));
+            clear_bit(SERVO_ACTIVE, &(hot->state));
+            delay = hot->t_next;
+        }
+        if (servo_park(servo))
+        {
+            return HRTIMER_NORESTART;
+        }
     }
 
-    return HRTIMER_RESTART;
+    raw_spin_lock_irqsave(&(servo->timer_lock), flags);
+    restart = servo_arm_edge(servo, delay) ? HRTIMER_RESTART : HRTIMER_NORESTART;
+    raw_spin_unlock_irqrestore(&(servo->timer_lock), flags);
+    servo_record_exec(&(servo->hist), now, ktime_get(), hrtimer_get_expires(timer));
+
+    return restart;
 }
 
-int servo_open(struct inode *inodep, struct file *filp)
+// Oneshot protocols start a pulse as soon as a setpoint is written, or a
+// frame after the last one if none arrives. Runs under the servo's
+// timer_lock, which servo_trigger() takes to move the next pulse forward.
+// The precision wait happens before, so no lock is held while spinning.
+static enum hrtimer_restart servo_oneshot(struct servo_data *servo, ktime_t expires, ktime_t now)
 {
-    unsigned int idx = MINOR(inodep->i_rdev);
+    enum hrtimer_restart restart = HRTIMER_RESTART;
+    unsigned long flags;
+    unsigned long delay;
+    ktime_t actual;
 
-    if (test_bit(SERVO_OPEN, (void *) &(servos[idx].flags)))
+    if (precision && test_bit(SERVO_ENABLED, &(servo->hot->state)))
     {
-        pr_warn("servos: [ERROR] A process tried to open servo %d when it was already opened.\n", idx);
-        return -1;
+        servo->margin_ns = servo_calibrate_margin(servo->margin_ns, expires, now);
+        servo_record_spin(servo, servo_spin_until(ktime_sub_ns(servo->t_edge, servo_slack(servo->hot))), servo->margin_ns);
     }
 
-    set_bit(SERVO_OPEN, (void *) &(servos[idx].flags));
-    filp->private_data = (void *) &(servos[idx]);
-    return 0;
-}
+    raw_spin_lock_irqsave(&(servo->timer_lock), flags);
 
-int servo_release(struct inode *inodep, struct file *filp)
-{
-    unsigned int idx = MINOR(inodep->i_rdev);
-    clear_bit(SERVO_OPEN, (void *) &(servos[idx].flags));
-    return 0;
-}
+    if (test_bit(SERVO_ACTIVE, &(servo->hot->state)))
+    {
+        servo_drive(servo, 0);
+        actual = ktime_get();
+        trace_servo_edge(servo->idx, 0, ktime_to_ns(servo->t_edge), ktime_to_ns(actual));
+        servo_record_edge(servo, 0, servo->t_edge, actual);
+        clear_bit(SERVO_ACTIVE, &(servo->hot->state));
+        servo->t_idle = servo->t_edge;
 
-ssize_t servo_read(struct file *filp, char __user *buf, size_t len, loff_t *off)
-{
-    struct servo_data *servo = (struct servo_data *)(filp->private_data);
-    unsigned int period_ns = atomic_read(&(servo->period_ns));
-    unsigned char kbuf[16];
-    size_t klen;
-    size_t min;
+        // a setpoint written during the pulse goes out after the gap
+        if (test_and_clear_bit(SERVO_TRIGGER, &(servo->hot->state)))
+        {
+            delay = servo->limits.gap_ns;
+        }
+        else
+        {
+            delay = servo->hot->frame_ns - servo->hot->t_switch;
+        }
+    }
+    else if (test_bit(SERVO_ENABLED, &(servo->hot->state)) && servo_proto(servo->hot) >= PROTO_ONESHOT125 && servo_proto(servo->hot) <= PROTO_MULTISHOT)
+    {
+        clear_bit(SERVO_TRIGGER, &(servo->hot->state));
+        servo->hot->t_switch = servo_next_period(servo, servo->t_edge);
+        servo_drive(servo, 1);
+        actual = ktime_get();
+        trace_servo_edge(servo->idx, 1, ktime_to_ns(servo->t_edge), ktime_to_ns(actual));
+        servo_record_edge(servo, 1, servo->t_edge, actual);
+        set_bit(SERVO_ACTIVE, &(servo->hot->state));
+        delay = servo->hot->t_switch;
 
-    if (*off > 0)
+        servo_arm_wake(servo, ktime_add_ns(servo->t_edge, servo->hot->frame_ns));
+    }
+    else
     {
-        return 0;
+        delay = servo->hot->frame_ns;
     }
 
-    klen = snprintf(kbuf, 16, "%u\n", period_ns);
+    // a servo switched to pwm or dshot hands over to the frame or dshot
+    // timer, a disabled one stops until re-enabled
+    if (!test_bit(SERVO_ACTIVE, &(servo->hot->state)) && ((consolidated && servo_proto(servo->hot) == PROTO_PWM) || servo_proto(servo->hot) >= PROTO_DSHOT150 || !test_bit(SERVO_ENABLED, &(servo->hot->state))))
+    {
+        set_bit(SERVO_STOPPED, &(servo->hot->state));
+        restart = HRTIMER_NORESTART;
+    }
 
-    min = len < klen ? len : klen;
+    if (!servo_arm_edge(servo, delay))
+    {
+        restart = HRTIMER_NORESTART;
+    }
 
-    if (copy_to_user(buf, kbuf, min))
+    raw_spin_unlock_irqrestore(&(servo->timer_lock), flags);
+
+    servo_record_exec(&(servo->hist), now, ktime_get(), hrtimer_get_expires(&(servo->timer)));
+
+    return restart;
+}
+
+// Moves a oneshot servo's next pulse forward to now, or to the end of the gap
+// after its last pulse. If a pulse is running it is sent once that ends.
+static void servo_trigger(struct servo_data *servo)
+{
+    unsigned long flags;
+    ktime_t t;
+
+    if (servo_proto(servo->hot) >= PROTO_DSHOT150)
     {
-        pr_err("servos: [ERROR] Could not write to output buffer.\n");
-        return 0;
+        servo_dshot_trigger(servo);
+        return;
     }
 
-    *off += min;
-    return min;
+    raw_spin_lock_irqsave(&(servo->timer_lock), flags);
+    if (test_bit(SERVO_ACTIVE, &(servo->hot->state)))
+    {
+        set_bit(SERVO_TRIGGER, &(servo->hot->state));
+    }
+    else if (test_bit(SERVO_ENABLED, &(servo->hot->state)))
+    {
+        // a callback that has not armed the timer yet sends the pulse
+        // itself, starting the timer under it would corrupt the queue
+        if (hrtimer_callback_running(&(servo->timer)) && !hrtimer_is_queued(&(servo->timer)) && !test_bit(SERVO_STOPPED, &(servo->hot->state)))
+        {
+            set_bit(SERVO_TRIGGER, &(servo->hot->state));
+        }
+        else
+        {
+            t = ktime_get();
+            if (ktime_before(t, ktime_add_ns(servo->t_idle, servo->limits.gap_ns)))
+            {
+                t = ktime_add_ns(servo->t_idle, servo->limits.gap_ns);
+            }
+            if (!hrtimer_is_queued(&(servo->timer)) || ktime_before(t, servo->t_edge))
+            {
+                clear_bit(SERVO_STOPPED, &(servo->hot->state));
+                servo->t_edge = t;
+                servo_start_edge(servo);
+            }
+        }
+    }
+    raw_spin_unlock_irqrestore(&(servo->timer_lock), flags);
 }
 
-ssize_t servo_write(struct file *filp, const char __user *buf, size_t len, loff_t *off)
+static void servo_enable(struct servo_data *servo, bool enable)
 {
-    struct servo_data *servo = (struct servo_data *)(filp->private_data);
-    unsigned int period_ns;
-    unsigned char kbuf[16];
-    size_t klen = len < 15 ? len : 15;
+    assign_bit(SERVO_ENABLED, &(servo->hot->state), enable);
+    servo_resched(servo);
+    if (servo->pwm)
+    {
+        servo_pwm_update(servo);
+    }
+    else if (enable)
+    {
+        servo_start(servo);
+    }
+    else
+    {
+        servo_stop(servo);
+    }
+}
 
-    if (copy_from_user(kbuf, buf, klen))
+// Restarts a stopped servo timer at the servo's next frame on the shared
+// grid, so re-enabled servos come back in phase
+static void servo_start(struct servo_data *servo)
+{
+    unsigned long frame_ns = servo->hot->frame_ns;
+    unsigned long phase;
+    unsigned long flags;
+    ktime_t now;
+    u64 k;
+
+    if (servo_proto(servo->hot) >= PROTO_DSHOT150)
     {
-        pr_err("servos: [ERROR] Could not read from input buffer.\n");
-        return 0;
+        servo_dshot_trigger(servo);
+        return;
+    }
+    if (servo->pwm)
+    {
+        return;
+    }
+    if (ppm || (consolidated && servo_proto(servo->hot) == PROTO_PWM))
+    {
+        if (test_bit(SERVO_ENABLED, &(servo->hot->state)))
+        {
+            servo_frame_wake();
+        }
+        return;
     }
 
-    kbuf[klen+1] = '\0';
-    if (sscanf(kbuf, "%d\n", &period_ns) != 1)
+    raw_spin_lock_irqsave(&(servo->timer_lock), flags);
+    if (test_bit(SERVO_ENABLED, &(servo->hot->state)) && test_and_clear_bit(SERVO_STOPPED, &(servo->hot->state)))
     {
-        pr_err("servos: [ERROR] Could not convert input \"%s\" to int.\n", kbuf);
-        return klen;
+        phase = min_t(unsigned long, atomic_read(&(servo->hot->phase_ns)), frame_ns - servo->hot->max_ns);
+        now = ktime_add_ns(ktime_get(), servo->margin_ns);
+        k = ktime_before(now, frame_origin) ? 0 : div_u64(ktime_to_ns(ktime_sub(now, frame_origin)), frame_ns) + 1;
+        clear_bit(SERVO_ACTIVE, &(servo->hot->state));
+        servo->hot->t_phase = phase;
+        servo->t_edge = ktime_add_ns(frame_origin, k*frame_ns + phase);
+        servo_start_edge(servo);
     }
+    raw_spin_unlock_irqrestore(&(servo->timer_lock), flags);
+}
 
-    if (period_ns < MIN_PERIOD)
+// Cancels a disabled servo's timer if it is waiting for the next pulse, a
+// running callback sees the servo disabled and stops by itself
+static void servo_stop(struct servo_data *servo)
+{
+    unsigned long flags;
+
+    raw_spin_lock_irqsave(&(servo->timer_lock), flags);
+    if (!test_bit(SERVO_ENABLED, &(servo->hot->state)) && hrtimer_try_to_cancel(&(servo->timer)) == 1)
     {
-        pr_warn("servos: [WARN] specified period of %dns is below minimum period of %dns, using minimum.\n", period_ns, MIN_PERIOD);
-        period_ns = MIN_PERIOD;
+        // a pulse that started meanwhile still gets its falling edge
+        if (test_bit(SERVO_ACTIVE, &(servo->hot->state)))
+        {
+            servo_start_edge(servo);
+        }
+        else
+        {
+            set_bit(SERVO_STOPPED, &(servo->hot->state));
+        }
     }
-    else if (period_ns > MAX_PERIOD)
+    raw_spin_unlock_irqrestore(&(servo->timer_lock), flags);
+}
+
+// Marks a pwm servo timer stopped unless the servo was enabled again, in
+// which case it keeps running
+static bool servo_park(struct servo_data *servo)
+{
+    unsigned long flags;
+    bool park;
+
+    raw_spin_lock_irqsave(&(servo->timer_lock), flags);
+    if ((park = !test_bit(SERVO_ENABLED, &(servo->hot->state))))
     {
-        pr_warn("servos: [WARN] specified period of %dns is above maximum period of %dns, using maximum.\n", period_ns, MIN_PERIOD);
-        period_ns = MAX_PERIOD;
+        set_bit(SERVO_STOPPED, &(servo->hot->state));
     }
-    
-    atomic_set(&(servo->period_ns), period_ns);
+    raw_spin_unlock_irqrestore(&(servo->timer_lock), flags);
 
-    return klen;
+    return park;
 }
 
-long servo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+// Sends a dshot frame to every enabled dshot servo, servos of the same speed
+// share bit slots. Frames repeat at the shortest frame period among them and
+// setpoint writes bring the next one forward, the timer stops once no dshot
+// servo is enabled.
+enum hrtimer_restart servo_dshot_cb(struct hrtimer *timer)
 {
-    struct servo_data *servo = (struct servo_data *)(filp->private_data);
-    unsigned int new_value = 0;
-    int success = 0;
+    ktime_t now = hrtimer_cb_get_time(timer);
+    unsigned long frame_ns = ULONG_MAX;
+    unsigned long flags;
 
-    switch (cmd)
+    raw_spin_lock_irqsave(&dshot_lock, flags);
+    frame_ns = servo_dshot_send(PROTO_DSHOT300, now, frame_ns);
+    frame_ns = servo_dshot_send(PROTO_DSHOT150, now, frame_ns);
+    dshot_idle = ktime_get();
+
+    // a timer started meanwhile keeps its expiry
+    if (hrtimer_is_queued(timer))
     {
-    case SERVO_ENB:
-        clear_bit(SERVO_ACTIVE, (void *) &(servo->flags));
-        set_bit(SERVO_ENABLED, (void *) &(servo->flags));
-        break;
-    case SERVO_DIS:
-        clear_bit(SERVO_ENABLED, (void *) &(servo->flags));
-        break;
-    case SERVO_INV:
-        change_bit(SERVO_INVERTED, (void *) &(servo->flags));
-        break;
-    case SERVO_WF:
-        if (copy_from_user(&new_value, (uint32_t *)arg, sizeof(new_value)))
+        frame_ns = ULONG_MAX;
+    }
+    else if (frame_ns != ULONG_MAX)
+    {
+        hrtimer_set_expires(timer, ktime_add_ns(now, frame_ns));
+    }
+    else
+    {
+        dshot_stopped = true;
+    }
+    raw_spin_unlock_irqrestore(&dshot_lock, flags);
+
+    return frame_ns == ULONG_MAX ? HRTIMER_NORESTART : HRTIMER_RESTART;
+}
+
+// Precomputes the output levels at every edge of a frame for all enabled
+// servos using proto, then emits them with a timed busy loop. Servos whose
+// pin the frame timer still drives wait until it lets go. Called with
+// dshot_lock held, returns frame_ns lowered to the shortest frame period of
+// the servos sent.
+static unsigned long servo_dshot_send(unsigned int proto, ktime_t now, unsigned long frame_ns)
+{
+    const struct servo_dshot_timing *timing = &(dshot_timings[proto - PROTO_DSHOT150]);
+    unsigned int words = BITS_TO_LONGS(n_servos);
+    unsigned long offset[3] = {0, timing->t0h_ns, timing->t1h_ns};
+    unsigned int n = 0;
+    unsigned int i;
+    unsigned int k;
+    int inverted;
+    u16 packet;
+    ktime_t t0;
+
+    bitmap_zero(dshot_steps, DSHOT_STEPS*words*BITS_PER_LONG);
+    for (i = 0; i < n_servos; i++)
+    {
+        if (servo_proto(servos[i].hot) != proto || !test_bit(SERVO_ENABLED, &(servos[i].hot->state)) || READ_ONCE(frame_slot[i]) != UINT_MAX)
         {
-            pr_err("servos: [ERROR] Servo %d received new flags, but could not apply them.\n", servo->idx);
-            success = -1;
-            break;
+            continue;
         }
-        if (new_value & (1 << SERVO_ENABLED))
+
+        servos[i].hot->t_switch = servo_next_period(&(servos[i]), now);
+        packet = servo_dshot_packet(servos[i].hot->t_switch);
+        inverted = test_bit(SERVO_INVERTED, &(servos[i].hot->state));
+        for (k = 0; k < DSHOT_BITS; k++)
         {
-            set_bit(SERVO_ENABLED, (void *) &(servo->flags));
-            pr_info("servos: setting enable.\n");
+            __assign_bit(n, dshot_steps + (3*k)*words, !inverted);
+            __assign_bit(n, dshot_steps + (3*k + 1)*words, (packet >> (DSHOT_BITS - 1 - k)) & 1 ? !inverted : inverted);
+            __assign_bit(n, dshot_steps + (3*k + 2)*words, inverted);
         }
-        else
+        dshot_desc[n] = servos[i].gpio;
+        assign_bit(i, servo_values, inverted);
+        frame_ns = min(frame_ns, servos[i].hot->frame_ns);
+        n++;
+    }
+
+    if (n == 0)
+    {
+        return frame_ns;
+    }
+
+    t0 = ktime_get();
+    for (k = 0; k < DSHOT_STEPS; k++)
+    {
+        servo_spin_until(ktime_add_ns(t0, (k/3)*timing->bit_ns + offset[k % 3]));
+        gpiod_set_array_value(n, dshot_desc, NULL, dshot_steps + k*words);
+    }
+
+    for (i = 0; i < n_servos; i++)
+    {
+        if (servo_proto(servos[i].hot) == proto && test_bit(SERVO_ENABLED, &(servos[i].hot->state)) && READ_ONCE(frame_slot[i]) == UINT_MAX)
         {
-            clear_bit(SERVO_ENABLED, (void *) &(servo->flags));
-            pr_info("servos: clearing enable.\n");
+            trace_servo_edge(i, 1, ktime_to_ns(now), ktime_to_ns(t0));
         }
-        if (new_value & (1 << SERVO_INVERTED))
+    }
+
+    return frame_ns;
+}
+
+// 11 bit throttle or command from the low bits of the setpoint, telemetry
+// request from bit 11 and a 4 bit checksum
+static u16 servo_dshot_packet(unsigned long setpoint)
+{
+    u16 value = ((setpoint & 0x7ff) << 1) | ((setpoint >> 11) & 1);
+
+    return (value << 4) | ((value ^ (value >> 4) ^ (value >> 8)) & 0xf);
+}
+
+// Brings the next dshot frame forward to now, or to the end of the servo's
+// gap after the last frame
+static void servo_dshot_trigger(struct servo_data *servo)
+{
+    unsigned long flags;
+    ktime_t t;
+
+    if (!test_bit(SERVO_ENABLED, &(servo->hot->state)))
+    {
+        return;
+    }
+
+    raw_spin_lock_irqsave(&dshot_lock, flags);
+
+    // a running callback that did not stop the timer sends the frame and
+    // arms the timer itself, starting the timer under it would corrupt the
+    // queue
+    if (hrtimer_callback_running(&dshot_timer) && !hrtimer_is_queued(&dshot_timer) && !dshot_stopped)
+    {
+        raw_spin_unlock_irqrestore(&dshot_lock, flags);
+        return;
+    }
+
+    t = ktime_get();
+    if (ktime_before(t, ktime_add_ns(dshot_idle, servo->limits.gap_ns)))
+    {
+        t = ktime_add_ns(dshot_idle, servo->limits.gap_ns);
+    }
+    if (!hrtimer_is_queued(&dshot_timer) || ktime_before(t, hrtimer_get_expires(&dshot_timer)))
+    {
+        dshot_stopped = false;
+        servo_start_timer(&dshot_remote, t, 0);
+    }
+    raw_spin_unlock_irqrestore(&dshot_lock, flags);
+}
+
+static int servo_alloc_dshot(void)
+{
+    dshot_desc = kcalloc(n_servos, sizeof(struct gpio_desc *), GFP_KERNEL);
+    dshot_steps = kcalloc(DSHOT_STEPS*BITS_TO_LONGS(n_servos), sizeof(unsigned long), GFP_KERNEL);
+    if (dshot_desc == NULL || dshot_steps == NULL)
+    {
+        servo_free_dshot();
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static void servo_free_dshot(void)
+{
+    kfree(dshot_desc);
+    kfree(dshot_steps);
+    dshot_desc = NULL;
+    dshot_steps = NULL;
+}
+
+// Fires ahead of each frame boundary while a commit is staged or io_uring
+// writes are queued, and stops once neither is left
+enum hrtimer_restart servo_commit_cb(struct hrtimer *timer)
+{
+    u64 frame = servo_frame_index(ktime_add_ns(hrtimer_get_expires(timer), COMMIT_LEAD));
+    unsigned long flags;
+    ktime_t boundary;
+    bool more;
+
+    servo_apply_commit();
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    servo_uring_apply(frame);
+#endif
+
+    // work that arrived meanwhile is left to this callback, see
+    // servo_commit_wake
+    raw_spin_lock_irqsave(&commit_lock, flags);
+    if ((more = commit_pending || !list_empty(&uring_queue)))
+    {
+        boundary = ktime_add_ns(frame_origin, (servo_frame_index(ktime_add_ns(ktime_get(), COMMIT_LEAD)) + 1)*SERVO_PERIOD);
+        hrtimer_set_expires(timer, ktime_sub_ns(boundary, COMMIT_LEAD));
+    }
+    else
+    {
+        commit_stopped = true;
+    }
+    raw_spin_unlock_irqrestore(&commit_lock, flags);
+
+    return more ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+// Runs in softirq context so waking userspace is safe even on PREEMPT_RT
+enum hrtimer_restart servo_wake_cb(struct hrtimer *timer)
+{
+    struct servo_data *servo = container_of(timer, struct servo_data, wake_timer);
+
+    atomic_inc(&(servo->wake_seq));
+    wake_up_interruptible(&(servo->wait));
+    kill_fasync(&(servo->fasync), SIGIO, POLL_IN);
+
+    return HRTIMER_NORESTART;
+}
+
+enum hrtimer_restart servo_frame_cb(struct hrtimer *timer)
+{
+    ktime_t start = hrtimer_cb_get_time(timer);
+    ktime_t now = start;
+    ktime_t t_edge;
+    ktime_t t_fired = 0;
+    ktime_t t_open;
+    ktime_t deadline;
+    unsigned long slack;
+    unsigned int i;
+    bool dirty = false;
+    u64 spin_ns;
+
+    if (ktime_before(now, hrtimer_get_expires(timer)))
+    {
+        servo_record_coalesced(&frame_hist);
+    }
+
+    if (precision)
+    {
+        frame_margin_ns = servo_calibrate_margin(frame_margin_ns, hrtimer_get_expires(timer), now);
+    }
+
+    // collect every edge that is due or within its tolerance of it, rolling
+    // into the next frame when the schedule for this one is exhausted
+    while (1)
+    {
+        if (edge_pos < n_edges)
         {
-            set_bit(SERVO_INVERTED, (void *) &(servo->flags));
-            pr_info("servos: setting invert.\n");
+            t_edge = ktime_add_ns(frame_start, edges[edge_pos].t_ns);
+            slack = servo_slack(&(servo_hot[edges[edge_pos].idx]));
         }
         else
         {
-            clear_bit(SERVO_INVERTED, (void *) &(servo->flags));
-            pr_info("servos: clearing invert.\n");
+            t_edge = ktime_add_ns(frame_start, SERVO_PERIOD);
+            slack = 0;
         }
-        pr_info("servos: [INFO] writing new flags (%d) to servo %d\n", new_value, servo->idx);
-        break;
-    case SERVO_RF:
-        if (test_bit(SERVO_ENABLED, (void *) &(servo->flags)))
+
+        if (ktime_after(ktime_sub_ns(t_edge, frame_margin_ns + slack), now))
         {
-            new_value |= (1 << SERVO_ENABLED);
+            break;
         }
-        if (test_bit(SERVO_INVERTED, (void *) &(servo->flags)))
+
+        // in precision mode, flush edges already staged and wait for this one
+        if (edge_pos < n_edges && ktime_after(ktime_sub_ns(t_edge, slack), now))
         {
-            new_value |= (1 << SERVO_INVERTED);
+            if (dirty)
+            {
+                servo_write_values();
+                dirty = false;
+            }
+            spin_ns = servo_spin_until(ktime_sub_ns(t_edge, slack));
+            now = ktime_get();
+            servo_record_spin(&(servos[edges[edge_pos].idx]), spin_ns, frame_margin_ns);
         }
-        if (copy_to_user((uint32_t *)arg, &new_value, sizeof(new_value)))
+
+        if (edge_pos < n_edges)
         {
-            pr_err("servos: [ERROR] Servo %d was asked for flags, but could not supply them.\n", servo->idx);
-            success = -2;
+            // an edge at a time of its own, driven no later than its
+            // tolerance allows, would otherwise have taken an expiry
+            if (t_fired && t_edge != t_fired && !ktime_after(now, ktime_add_ns(t_edge, slack + frame_margin_ns)))
+            {
+                servo_record_coalesced(&(servos[edges[edge_pos].idx].hist));
+                servo_record_coalesced(&frame_hist);
+            }
+            t_fired = t_edge;
+
+            servo_record_lateness(&(servos[edges[edge_pos].idx]), t_edge, now);
+            trace_servo_edge(edges[edge_pos].idx, edges[edge_pos].active, ktime_to_ns(t_edge), ktime_to_ns(now));
+            dirty |= servo_fire_edge(&(edges[edge_pos]));
+            servo_record_edge(&(servos[edges[edge_pos].idx]), edges[edge_pos].active, t_edge, now);
+            if (edges[edge_pos].active)
+            {
+                servo_arm_wake(&(servos[edges[edge_pos].idx]), ktime_add_ns(t_edge, servo_hot[edges[edge_pos].idx].frame_ns));
+            }
+            edge_pos++;
         }
-        pr_info("servos: [INFO] reading flags (%d) from servo %d\n", new_value, servo->idx);
-        break;
-    case SERVO_WV:
-        if (copy_from_user(&new_value, (uint32_t *)arg, sizeof(new_value)))
+        else
+        {
+            frame_start = t_edge;
+            servo_apply_commit();
+            servo_build_edges();
+        }
+    }
+
+    // all edges due at this instant go out in a single write
+    if (dirty)
+    {
+        servo_write_values();
+    }
+
+    // an empty frame means no servo is enabled and no pulse is running
+    if (n_edges == 0 && servo_frame_idle())
+    {
+        servo_record_exec(&frame_hist, start, ktime_get(), KTIME_MAX);
+        return HRTIMER_NORESTART;
+    }
+
+    // the next expiry may run once the next edge's window opens and until the
+    // first edge that can join it would be too late
+    t_open = ktime_sub_ns(t_edge, slack);
+    deadline = ktime_add_ns(t_edge, slack);
+    for (i = edge_pos + 1; i < n_edges; i++)
+    {
+        t_edge = ktime_add_ns(frame_start, edges[i].t_ns);
+        slack = servo_slack(&(servo_hot[edges[i].idx]));
+        if (ktime_after(ktime_sub_ns(t_edge, slack), deadline))
         {
-            pr_err("servos: [ERROR] Servo %d received new value, but could not apply them.\n", servo->idx);
-            success = -3;
             break;
         }
-        if (new_value < MIN_PERIOD)
+        if (ktime_before(ktime_add_ns(t_edge, slack), deadline))
         {
-            pr_warn("servos: [WARN] On Servo %d, specified period of %dns is below minimum period of %dns, using minimum.\n", servo->idx, new_value, MIN_PERIOD);
-            new_value = MIN_PERIOD;
+            deadline = ktime_add_ns(t_edge, slack);
         }
-        else if (new_value > MAX_PERIOD)
+    }
+    hrtimer_set_expires_range_ns(timer, ktime_sub_ns(t_open, frame_margin_ns), ktime_to_ns(ktime_sub(deadline, t_open)));
+    servo_record_exec(&frame_hist, start, ktime_get(), hrtimer_get_expires(timer));
+
+    return HRTIMER_RESTART;
+}
+
+// Generates the whole ppm pulse train. Every channel starts with a separator
+// pulse and lasts for its setpoint, a sync gap fills the rest of the frame.
+enum hrtimer_restart servo_ppm_cb(struct hrtimer *timer)
+{
+    ktime_t expires = hrtimer_get_expires(timer);
+    ktime_t now = hrtimer_cb_get_time(timer);
+    unsigned int idx = ppm_slot < n_servos ? ppm_slot : n_servos - 1;
+    unsigned long delay;
+
+    servo_record_lateness(&(servos[idx]), expires, now);
+
+    if (precision)
+    {
+        frame_margin_ns = servo_calibrate_margin(frame_margin_ns, expires, now);
+        servo_record_spin(&(servos[idx]), servo_spin_until(ppm_edge), frame_margin_ns);
+    }
+
+    if (!ppm_active)
+    {
+        // the line stays idle and the timer stops while no channel is enabled
+        if (ppm_slot == 0 && !servo_ppm_begin())
         {
-            pr_warn("servos: [WARN] On Servo %d, pecified period of %dns is above maximum period of %dns, using maximum.\n", servo->idx, new_value, MIN_PERIOD);
-            new_value = MAX_PERIOD;
+            if (servo_frame_idle())
+            {
+                servo_record_exec(&frame_hist, now, ktime_get(), KTIME_MAX);
+                return HRTIMER_NORESTART;
+            }
+            delay = ppm_frame_ns;
         }
-        atomic_set(&(servo->period_ns), new_value);
-        break;
-    case SERVO_RV:
-        new_value = atomic_read(&(servo->period_ns));
+        else
+        {
+            gpiod_set_value(servo_gpios->desc[0], !ppm_inverted);
+            trace_servo_edge(idx, 1, ktime_to_ns(ppm_edge), ktime_get_ns());
+            ppm_active = true;
+            delay = ppm_separator_ns;
+        }
+    }
+    else
+    {
+        gpiod_set_value(servo_gpios->desc[0], ppm_inverted);
+        trace_servo_edge(idx, 0, ktime_to_ns(ppm_edge), ktime_get_ns());
+        ppm_active = false;
+        if (ppm_slot < n_servos)
+        {
+            delay = servos[ppm_slot].hot->t_switch - ppm_separator_ns;
+            ppm_slot++;
+        }
+        else
+        {
+            delay = ppm_sync_ns;
+            ppm_slot = 0;
+        }
+    }
 
-        if (copy_to_user((uint32_t *)arg, &new_value, sizeof(new_value)))
+    ppm_edge = ktime_add_ns(ppm_edge, delay);
+    hrtimer_set_expires(timer, ktime_sub_ns(ppm_edge, frame_margin_ns));
+    servo_record_exec(&frame_hist, now, ktime_get(), hrtimer_get_expires(timer));
+
+    return HRTIMER_RESTART;
+}
+
+// Applies a hardware pwm servo's setpoint, limits and flags. The hardware
+// repeats the pulse by itself, the work only comes back each frame, or each
+// jiffy if that is longer, while a trajectory, an interpolation or the shared
+// setpoint page may still move the pulse, or someone waits for frame wakeups.
+static void servo_pwm_work(struct work_struct *work)
+{
+    struct servo_data *servo = container_of(to_delayed_work(work), struct servo_data, pwm_work);
+    unsigned long state = READ_ONCE(servo->hot->state);
+    struct pwm_state pwm_state;
+    ktime_t now = ktime_get();
+    unsigned long width;
+
+    width = servo_next_period(servo, now);
+
+    pwm_init_state(servo->pwm, &pwm_state);
+    pwm_state.period = servo->hot->frame_ns;
+    pwm_state.duty_cycle = width;
+    pwm_state.polarity = (state & BIT(SERVO_INVERTED)) ? PWM_POLARITY_INVERSED : PWM_POLARITY_NORMAL;
+    pwm_state.enabled = !!(state & BIT(SERVO_ENABLED));
+    if (pwm_apply_state(servo->pwm, &pwm_state))
+    {
+        pr_warn_ratelimited("servos: [WARN] Could not apply pwm state for servo %d.\n", servo->idx);
+    }
+
+    if (!pwm_state.enabled)
+    {
+        return;
+    }
+    servo_arm_wake(servo, ktime_add_ns(now, servo->hot->frame_ns));
+    if (!kfifo_is_empty(&(servo->traj)) || width != servo->motion_target || atomic_read(&(servo->shm_maps)) || test_bit(SERVO_OPEN, &(servo->hot->state)))
+    {
+        schedule_delayed_work(&(servo->pwm_work), max_t(unsigned long, nsecs_to_jiffies(servo->hot->frame_ns), 1));
+    }
+}
+
+// Brings a hardware pwm servo's next update forward to now
+static void servo_pwm_update(struct servo_data *servo)
+{
+    if (servo->pwm)
+    {
+        mod_delayed_work(system_wq, &(servo->pwm_work), 0);
+    }
+}
+
+static void servo_free_pwm(void)
+{
+    unsigned int i;
+
+    for (i = n_gpio_servos; i < n_servos; i++)
+    {
+        if (servos[i].pwm)
         {
-            pr_err("servos: [ERROR] Servo %d was asked to for value, but could not supply it.\n", servo->idx);
-            success = -4;
+            cancel_delayed_work_sync(&(servos[i].pwm_work));
+            pwm_disable(servos[i].pwm);
+            pwm_put(servos[i].pwm);
         }
-        break;
-    default:
-        pr_warn("servos: [WARN] Servo %d received unknown IOCTL command %d.\n", servo->idx, cmd);
-        success = -5;
-        break;
+    }
+}
+
+// Latches every channel's width at the start of a ppm frame, disabled
+// channels keep their slot at the current setpoint. Returns false if no
+// channel is enabled.
+static bool servo_ppm_begin(void)
+{
+    unsigned long total = ppm_separator_ns;
+    bool enabled = false;
+    unsigned int i;
+
+    for (i = 0; i < n_servos; i++)
+    {
+        enabled |= test_bit(SERVO_ENABLED, &(servos[i].hot->state));
+        servos[i].hot->t_switch = max_t(unsigned long, servo_next_period(&(servos[i]), ppm_edge), ppm_separator_ns + MIN_LOW);
+        total += servos[i].hot->t_switch;
+    }
+    ppm_sync_ns = total + PPM_MIN_SYNC > ppm_frame_ns ? PPM_MIN_SYNC : ppm_frame_ns - total;
+
+    for (i = 0; enabled && i < n_servos; i++)
+    {
+        servo_arm_wake(&(servos[i]), ktime_add_ns(ppm_edge, total + ppm_sync_ns));
+    }
+
+    return enabled;
+}
+
+// Picks up new limits, trajectory points that are due by t_start and any
+// setpoint the servo's owner stored in the shared page since the last pulse,
+// the most recent write through the page or the device file wins
+static unsigned long servo_next_period(struct servo_data *servo, ktime_t t_start)
+{
+    uint32_t shm_value = READ_ONCE(servo_shm[servo->idx]);
+    struct servo_point point;
+    unsigned long flags;
+
+    if (test_and_clear_bit(SERVO_LIMITS, &(servo->hot->state)))
+    {
+        raw_spin_lock_irqsave(&limits_lock, flags);
+        servo->hot->frame_ns = servo->limits.frame_ns;
+        servo->hot->min_ns = servo->limits.min_ns;
+        servo->hot->max_ns = servo->limits.max_ns;
+        raw_spin_unlock_irqrestore(&limits_lock, flags);
+    }
+
+    if (test_and_clear_bit(SERVO_FLUSH, &(servo->hot->state)))
+    {
+        kfifo_reset_out(&(servo->traj));
+    }
+
+    while (kfifo_peek(&(servo->traj), &point) && point.t_ns <= ktime_to_ns(t_start))
+    {
+        servo_set_period(servo, point.period_ns, SETPOINT_TRAJECTORY);
+        kfifo_skip(&(servo->traj));
+    }
+
+    if (shm_value != servo->hot->shm_seen && atomic_read(&(servo->shm_maps)))
+    {
+        servo->hot->shm_seen = shm_value;
+        servo_set_period(servo, servo_clamp_period(servo, shm_value), SETPOINT_SHM);
+    }
+
+    // setpoints were clamped to limits that may have changed since, dshot
+    // setpoints are not pulse widths and are never interpolated
+    if (servo_proto(servo->hot) >= PROTO_DSHOT150)
+    {
+        return clamp_t(unsigned long, atomic_read(&(servo->hot->period_ns)), servo->hot->min_ns, servo->hot->max_ns);
+    }
+
+    return servo_motion(servo, clamp_t(unsigned long, atomic_read(&(servo->hot->period_ns)), servo->hot->min_ns, servo->hot->max_ns), t_start);
+}
+
+// Moves the applied pulse width toward the target. A new target starts an
+// interpolation from the current width lasting interp_ns, the slew limit then
+// caps the change from one pulse to the next.
+static unsigned long servo_motion(struct servo_data *servo, unsigned long target, ktime_t t_start)
+{
+    unsigned int interp = atomic_read(&(servo->interp));
+    u64 interp_ns = (uint32_t)atomic_read(&(servo->interp_ns));
+    unsigned long slew = (uint32_t)atomic_read(&(servo->slew_ns));
+    unsigned long width = target;
+    u64 p;
+
+    if (target != servo->motion_target)
+    {
+        servo->motion_from = servo->hot->applied_ns;
+        servo->motion_target = target;
+        servo->motion_t0 = t_start;
+    }
+
+    // progress through the interpolation in 1/65536ths
+    if (interp != INTERP_STEP && interp_ns > 0 && !ktime_before(t_start, servo->motion_t0) && ktime_before(t_start, ktime_add_ns(servo->motion_t0, interp_ns)))
+    {
+        p = div64_u64((u64)ktime_to_ns(ktime_sub(t_start, servo->motion_t0)) << 16, interp_ns);
+        if (interp == INTERP_EASE)
+        {
+            p = (((p*p) >> 16)*(3*65536 - 2*p)) >> 16;
+        }
+        width = servo->motion_from + (long)((((s64)target - (s64)servo->motion_from)*(s64)p) >> 16);
+    }
+
+    if (slew > 0 && width > servo->hot->applied_ns + slew)
+    {
+        width = servo->hot->applied_ns + slew;
+    }
+    else if (slew > 0 && width + slew < servo->hot->applied_ns)
+    {
+        width = servo->hot->applied_ns - slew;
+    }
+
+    servo->hot->applied_ns = clamp_t(unsigned long, width, servo->hot->min_ns, servo->hot->max_ns);
+    return servo->hot->applied_ns;
+}
+
+// Time from the start of one pulse to the start of the next. A phase change
+// shifts the next pulse, but never leaves less low time than the frame does
+// at the longest pulse, or a minimum pulse worth, whichever is shorter
+static unsigned long servo_next_start(struct servo_data *servo, unsigned long width)
+{
+    unsigned long max_phase = servo->hot->frame_ns - servo->hot->max_ns;
+    unsigned long phase = min_t(unsigned long, atomic_read(&(servo->hot->phase_ns)), max_phase);
+    long delay = (long)servo->hot->frame_ns + (long)phase - (long)servo->hot->t_phase;
+
+    while (delay < (long)(width + min_t(unsigned long, max_phase, MIN_PERIOD)))
+    {
+        delay += servo->hot->frame_ns;
+    }
+    servo->hot->t_phase = phase;
+
+    return delay;
+}
+
+// Limits a period to the servo's range, counting requests that were outside it
+static uint32_t servo_clamp_period(struct servo_data *servo, uint32_t period_ns)
+{
+    uint32_t min_ns = READ_ONCE(servo->limits.min_ns);
+    uint32_t max_ns = READ_ONCE(servo->limits.max_ns);
+
+    if (period_ns < min_ns)
+    {
+        atomic_inc(&(servo->below_min));
+        return min_ns;
+    }
+    if (period_ns > max_ns)
+    {
+        atomic_inc(&(servo->above_max));
+        return max_ns;
+    }
+
+    return period_ns;
+}
+
+// Frames may be anywhere from MIN_FRAME to SERVO_PERIOD long and must leave
+// room for some low time after the longest pulse
+// Only dshot setpoints may be 0, they are throttle values rather than pulse
+// widths
+static int servo_check_limits(const struct servo_limits *limits, unsigned int proto)
+{
+    if (limits->frame_ns < MIN_FRAME || limits->frame_ns > SERVO_PERIOD)
+    {
+        return -EINVAL;
+    }
+    if ((limits->min_ns == 0 && proto < PROTO_DSHOT150) || limits->min_ns > limits->max_ns)
+    {
+        return -EINVAL;
+    }
+    if (limits->max_ns > limits->frame_ns - MIN_LOW)
+    {
+        return -EINVAL;
+    }
+    if (limits->gap_ns > limits->frame_ns)
+    {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+// New limits are picked up by the servo's timer at its next pulse, the
+// setpoint and phase are brought into the new range right away
+static void servo_set_limits(struct servo_data *servo, const struct servo_limits *limits)
+{
+    unsigned long flags;
+
+    raw_spin_lock_irqsave(&limits_lock, flags);
+    servo->limits = *limits;
+    set_bit(SERVO_LIMITS, &(servo->hot->state));
+    raw_spin_unlock_irqrestore(&limits_lock, flags);
+
+    servo_set_period(servo, clamp_t(uint32_t, atomic_read(&(servo->hot->period_ns)), limits->min_ns, limits->max_ns), SETPOINT_IOCTL);
+    if (atomic_read(&(servo->hot->phase_ns)) > limits->frame_ns - limits->max_ns)
+    {
+        atomic_set(&(servo->hot->phase_ns), limits->frame_ns - limits->max_ns);
+    }
+}
+
+static unsigned int servo_proto(const struct servo_hot *hot)
+{
+    return (READ_ONCE(hot->state) & SERVO_PROTO_MASK) >> SERVO_PROTO_SHIFT;
+}
+
+// Switches protocol and loads its default limits. A oneshot servo in
+// consolidated mode gets its timer started by the trigger, pwm servos rejoin
+// the frame schedule at the next frame.
+static void servo_set_proto(struct servo_data *servo, unsigned int proto)
+{
+    unsigned long state;
+
+    servo_set_limits(servo, &(servo_protocols[proto]));
+    do
+    {
+        state = READ_ONCE(servo->hot->state);
+    } while (cmpxchg(&(servo->hot->state), state, (state & ~SERVO_PROTO_MASK) | ((unsigned long)proto << SERVO_PROTO_SHIFT)) != state);
+    servo_resched(servo);
+
+    if (proto != PROTO_PWM)
+    {
+        servo_trigger(servo);
+        return;
+    }
+
+    // a servo timer that stopped for dshot resumes pwm
+    servo_start(servo);
+}
+
+// Setpoints written by userspace send a oneshot pulse right away
+static void servo_set_period(struct servo_data *servo, uint32_t period_ns, int source)
+{
+    atomic_set(&(servo->hot->period_ns), period_ns);
+    trace_servo_setpoint(servo->idx, period_ns, source);
+    servo_resched(servo);
+    servo_pwm_update(servo);
+
+    if ((source == SETPOINT_WRITE || source == SETPOINT_IOCTL) && servo_proto(servo->hot) != PROTO_PWM)
+    {
+        servo_trigger(servo);
+    }
+}
+
+// Appends points to the trajectory queue, the timer is the only consumer
+static long servo_queue_trajectory(struct servo_data *servo, struct servo_trajectory __user *arg)
+{
+    struct servo_trajectory traj;
+    struct servo_point *points;
+    unsigned int i;
+
+    if (copy_from_user(&traj, arg, sizeof(traj)))
+    {
+        return -EFAULT;
+    }
+    if (traj.count == 0 || traj.count > TRAJECTORY_LEN)
+    {
+        return -EINVAL;
+    }
+    if ((points = kmalloc_array(traj.count, sizeof(struct servo_point), GFP_KERNEL)) == NULL)
+    {
+        return -ENOMEM;
+    }
+    if (copy_from_user(points, u64_to_user_ptr(traj.points), traj.count*sizeof(struct servo_point)))
+    {
+        kfree(points);
+        return -EFAULT;
+    }
+    for (i = 0; i < traj.count; i++)
+    {
+        points[i].period_ns = servo_clamp_period(servo, points[i].period_ns);
+    }
+
+    mutex_lock(&(servo->traj_lock));
+    traj.queued = kfifo_in(&(servo->traj), points, traj.count);
+    mutex_unlock(&(servo->traj_lock));
+    servo_resched(servo);
+    servo_pwm_update(servo);
+
+    kfree(points);
+
+    if (copy_to_user(arg, &traj, sizeof(traj)))
+    {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static int servo_alloc_commit(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        commit_bufs[i].mask = bitmap_zalloc(n_servos, GFP_KERNEL);
+        commit_bufs[i].period_ns = kcalloc(n_servos, sizeof(uint32_t), GFP_KERNEL);
+        if (commit_bufs[i].mask == NULL || commit_bufs[i].period_ns == NULL)
+        {
+            servo_free_commit();
+            return -ENOMEM;
+        }
+    }
+
+    commit_staging = 0;
+    commit_pending = false;
+    return 0;
+}
+
+static void servo_free_commit(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        bitmap_free(commit_bufs[i].mask);
+        kfree(commit_bufs[i].period_ns);
+        commit_bufs[i].mask = NULL;
+        commit_bufs[i].period_ns = NULL;
+    }
+}
+
+// Stages a commit into the buffer the next frame boundary will apply
+static long servo_stage_commit(struct servo_data *servo, struct servo_commit __user *arg)
+{
+    struct servo_commit commit;
+    long success;
+
+    if (copy_from_user(&commit, arg, sizeof(commit)))
+    {
+        return -EFAULT;
+    }
+    if ((success = servo_stage_setpoints(servo, commit.count, commit.setpoints, &(commit.frame))) < 0)
+    {
+        return success;
+    }
+    if (copy_to_user(arg, &commit, sizeof(commit)))
+    {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+// Stages count setpoints read from the user pointer for the next frame
+// boundary, frame returns the index of that frame. Servos opened or claimed
+// by someone other than the caller are refused.
+static long servo_stage_setpoints(struct servo_data *servo, uint32_t count, uint64_t user_setpoints, u64 *frame)
+{
+    struct servo_setpoint *setpoints;
+    struct servo_commit_buf *buf;
+    unsigned long flags;
+    unsigned int i;
+
+    if (IS_ERR(setpoints = servo_copy_setpoints(count, user_setpoints)))
+    {
+        return PTR_ERR(setpoints);
+    }
+
+    // ownership holds until the commit is staged
+    mutex_lock(&ctl_lock);
+    if (!servo_may_write_all(servo, setpoints, count))
+    {
+        mutex_unlock(&ctl_lock);
+        kfree(setpoints);
+        return -EACCES;
+    }
+
+    // servo timers need the commit applied ahead of the first pulse of the
+    // frame, the frame timer applies it right at the boundary
+    raw_spin_lock_irqsave(&commit_lock, flags);
+    buf = &(commit_bufs[commit_staging]);
+    for (i = 0; i < count; i++)
+    {
+        set_bit(setpoints[i].idx, buf->mask);
+        buf->period_ns[setpoints[i].idx] = servo_clamp_period(&(servos[setpoints[i].idx]), setpoints[i].period_ns);
+    }
+    commit_pending = true;
+    *frame = servo_frame_index(ktime_add_ns(ktime_get(), consolidated ? 0 : COMMIT_LEAD)) + 1;
+    if (!consolidated)
+    {
+        servo_commit_wake();
+    }
+    raw_spin_unlock_irqrestore(&commit_lock, flags);
+    mutex_unlock(&ctl_lock);
+
+    kfree(setpoints);
+
+    // an idle frame timer comes back to apply the commit
+    if (consolidated)
+    {
+        servo_frame_wake();
+    }
+
+    return 0;
+}
+
+// Copies count setpoints from the user pointer and checks their servo
+// indices, the caller frees the returned array
+static struct servo_setpoint *servo_copy_setpoints(uint32_t count, uint64_t user_setpoints)
+{
+    struct servo_setpoint *setpoints;
+    unsigned int i;
+
+    if (count == 0 || count > n_servos)
+    {
+        return ERR_PTR(-EINVAL);
+    }
+    if ((setpoints = kmalloc_array(count, sizeof(struct servo_setpoint), GFP_KERNEL)) == NULL)
+    {
+        return ERR_PTR(-ENOMEM);
+    }
+    if (copy_from_user(setpoints, u64_to_user_ptr(user_setpoints), count*sizeof(struct servo_setpoint)))
+    {
+        kfree(setpoints);
+        return ERR_PTR(-EFAULT);
+    }
+    for (i = 0; i < count; i++)
+    {
+        if (setpoints[i].idx >= n_servos)
+        {
+            kfree(setpoints);
+            return ERR_PTR(-EINVAL);
+        }
+    }
+
+    return setpoints;
+}
+
+// Starts the commit timer ahead of the next frame boundary if it stopped, a
+// running callback looks for new work before it stops. Called under
+// commit_lock.
+static void servo_commit_wake(void)
+{
+    ktime_t boundary;
+
+    if (!commit_stopped)
+    {
+        return;
+    }
+    commit_stopped = false;
+    boundary = ktime_add_ns(frame_origin, (servo_frame_index(ktime_add_ns(ktime_get(), COMMIT_LEAD)) + 1)*SERVO_PERIOD);
+    servo_start_timer(&commit_remote, ktime_sub_ns(boundary, COMMIT_LEAD), 0);
+}
+
+// Swaps the commit buffers and applies the staged half, so a commit is
+// either fully visible to a frame or not at all
+static void servo_apply_commit(void)
+{
+    struct servo_commit_buf *buf;
+    unsigned long flags;
+    unsigned int i;
+
+    raw_spin_lock_irqsave(&commit_lock, flags);
+    if (!commit_pending)
+    {
+        raw_spin_unlock_irqrestore(&commit_lock, flags);
+        return;
+    }
+    buf = &(commit_bufs[commit_staging]);
+    commit_staging ^= 1;
+    commit_pending = false;
+    raw_spin_unlock_irqrestore(&commit_lock, flags);
+
+    for_each_set_bit(i, buf->mask, n_servos)
+    {
+        servo_set_period(&(servos[i]), buf->period_ns[i], SETPOINT_COMMIT);
+    }
+    bitmap_zero(buf->mask, n_servos);
+}
+
+static u64 servo_frame_index(ktime_t t)
+{
+    if (ktime_before(t, frame_origin))
+    {
+        return 0;
+    }
+
+    return div_u64(ktime_to_ns(ktime_sub(t, frame_origin)), SERVO_PERIOD);
+}
+
+static void servo_place_timer(struct servo_remote *remote, struct hrtimer *timer, int cpu)
+{
+    remote->timer = timer;
+    remote->cpu = cpu;
+    INIT_CSD(&(remote->csd), servo_remote_cb, remote);
+}
+
+// Starts a timer at absolute time t on its cpu, it may run up to slack
+// later. Timers restarted from their own callback stay put, starts from
+// elsewhere go through an ipi to the placed cpu. A start already in flight
+// picks up the latest expiry and an offline cpu falls back to the calling one.
+static void servo_start_timer(struct servo_remote *remote, ktime_t t, u64 slack)
+{
+    int cpu = get_cpu();
+
+    if (remote->cpu < 0 || remote->cpu == cpu)
+    {
+        hrtimer_start_range_ns(remote->timer, t, slack, timer_mode & ~HRTIMER_MODE_REL);
+        put_cpu();
+        return;
+    }
+    put_cpu();
+
+    WRITE_ONCE(remote->expires, t);
+    WRITE_ONCE(remote->slack, slack);
+    if (smp_call_function_single_async(remote->cpu, &(remote->csd)) == -ENXIO)
+    {
+        hrtimer_start_range_ns(remote->timer, t, slack, timer_mode & ~HRTIMER_MODE_REL);
+    }
+}
+
+static void servo_remote_cb(void *info)
+{
+    struct servo_remote *remote = info;
+
+    hrtimer_start_range_ns(remote->timer, READ_ONCE(remote->expires), READ_ONCE(remote->slack), timer_mode & ~HRTIMER_MODE_REL);
+}
+
+static unsigned int servo_precision(const struct servo_hot *hot)
+{
+    return (READ_ONCE(hot->state) & SERVO_CLASS_MASK) >> SERVO_CLASS_SHIFT;
+}
+
+// Takes effect from the servo's next edge on
+static void servo_set_precision(struct servo_data *servo, unsigned int class)
+{
+    unsigned long state;
+
+    do
+    {
+        state = READ_ONCE(servo->hot->state);
+    } while (cmpxchg(&(servo->hot->state), state, (state & ~SERVO_CLASS_MASK) | ((unsigned long)class << SERVO_CLASS_SHIFT)) != state);
+}
+
+// How far an edge of the servo may move either way, at most a quarter of
+// the shortest pulse so a pulse never shrinks below half its width
+static unsigned long servo_slack(const struct servo_hot *hot)
+{
+    return min_t(unsigned long, tolerance_ns[servo_precision(hot)], hot->min_ns / 4);
+}
+
+// Moves t_edge on by delay and sets the servo timer for it from within its
+// callback, the timer may run anywhere within the servo's slack of it and so
+// share an interrupt with other timers. Runs under the servo's timer_lock.
+// Returns false if the timer was started meanwhile, its expiry then stands.
+static bool servo_arm_edge(struct servo_data *servo, unsigned long delay)
+{
+    unsigned long slack = servo_slack(servo->hot);
+
+    if (hrtimer_is_queued(&(servo->timer)))
+    {
+        return false;
+    }
+    servo->t_edge = ktime_add_ns(servo->t_edge, delay);
+    hrtimer_set_expires_range_ns(&(servo->timer), ktime_sub_ns(servo->t_edge, servo->margin_ns + slack), 2*slack);
+
+    return true;
+}
+
+// Starts the servo timer for the edge at t_edge from outside its callback
+static void servo_start_edge(struct servo_data *servo)
+{
+    unsigned long slack = servo_slack(servo->hot);
+
+    servo_start_timer(&(servo->remote), ktime_sub_ns(servo->t_edge, servo->margin_ns + slack), 2*slack);
+}
+
+// Schedules a wakeup the configured lead ahead of the pulse starting at
+// t_start, only while someone has the servo open
+static void servo_arm_wake(struct servo_data *servo, ktime_t t_start)
+{
+    if (!test_bit(SERVO_OPEN, &(servo->hot->state)))
+    {
+        return;
+    }
+
+    hrtimer_start(&(servo->wake_timer), ktime_sub_ns(t_start, atomic_read(&(servo->wake_lead_ns))), HRTIMER_MODE_ABS_SOFT);
+}
+
+static int servo_edge_cmp(const void *a, const void *b)
+{
+    const struct servo_edge *ea = a;
+    const struct servo_edge *eb = b;
+
+    if (ea->t_ns != eb->t_ns)
+    {
+        return ea->t_ns < eb->t_ns ? -1 : 1;
+    }
+
+    // at equal times, end pulses before starting new ones, but a servo's own
+    // zero width pulse starts before it ends
+    if (ea->idx == eb->idx)
+    {
+        return (int)eb->active - (int)ea->active;
+    }
+    return (int)ea->active - (int)eb->active;
+}
+
+// The schedule stays sorted from one frame to the next. Only servos marked
+// in edges_dirty get their edges rebuilt, the old ones are dropped and the
+// new ones sorted among themselves and merged in, so a frame without changes
+// reuses the schedule as it is.
+static void servo_build_edges(void)
+{
+    ktime_t frame_end = ktime_add_ns(frame_start, SERVO_PERIOD);
+    unsigned int words = BITS_TO_LONGS(n_servos);
+    unsigned int n_new = 0;
+    unsigned int n_kept = 0;
+    unsigned long rebuild = 0;
+    unsigned int i;
+    bool stable;
+    bool pins = false;
+
+    edge_pos = 0;
+
+    // setpoints stored to the shared page arrive without notice
+    if (atomic_read(&shm_maps) > 0)
+    {
+        for (i = 0; i < n_gpio_servos; i++)
+        {
+            if (READ_ONCE(servo_shm[i]) != servo_hot[i].shm_seen && atomic_read(&(servos[i].shm_maps)))
+            {
+                set_bit(i, edges_dirty);
+            }
+        }
+    }
+
+    for (i = 0; i < words; i++)
+    {
+        edges_rebuild[i] = xchg(&(edges_dirty[i]), 0);
+        rebuild |= edges_rebuild[i];
+    }
+    if (!rebuild)
+    {
+        return;
+    }
+
+    // servos whose pulses will differ next frame stay marked, servos that
+    // changed protocol join or leave the frame's pins
+    for_each_set_bit(i, edges_rebuild, n_gpio_servos)
+    {
+        n_new += servo_build_pulses(&(servos[i]), &(edges_new[n_new]), frame_end, &stable);
+        if (!stable)
+        {
+            set_bit(i, edges_dirty);
+        }
+        if ((servo_proto(&(servo_hot[i])) == PROTO_PWM) != test_bit(i, frame_pins))
+        {
+            change_bit(i, frame_pins);
+            pins = true;
+        }
+    }
+    if (pins)
+    {
+        servo_frame_pins();
+
+        // dshot skipped servos while the frame still drove their pin, with
+        // the pin released their frames start again
+        for_each_set_bit(i, edges_rebuild, n_gpio_servos)
+        {
+            if (servo_proto(&(servo_hot[i])) >= PROTO_DSHOT150)
+            {
+                servo_dshot_trigger(&(servos[i]));
+            }
+        }
+    }
+    sort(edges_new, n_new, sizeof(struct servo_edge), servo_edge_cmp, NULL);
+
+    for (i = 0; i < n_edges; i++)
+    {
+        if (!test_bit(edges[i].idx, edges_rebuild))
+        {
+            edges[n_kept++] = edges[i];
+        }
+    }
+
+    // merge from the back so the kept edges can stay in place
+    n_edges = n_kept + n_new;
+    for (i = n_edges; n_new > 0; )
+    {
+        if (n_kept > 0 && servo_edge_cmp(&(edges[n_kept - 1]), &(edges_new[n_new - 1])) > 0)
+        {
+            edges[--i] = edges[--n_kept];
+        }
+        else
+        {
+            edges[--i] = edges_new[--n_new];
+        }
+    }
+}
+
+// Adds the edges of every pulse a servo starts within the frame, servos run
+// on their own frame period so there may be several. Pulses that end after
+// the frame do so in the next one. Returns the number of edges added, stable
+// is set if the next frame would get the very same edges.
+static unsigned int servo_build_pulses(struct servo_data *servo, struct servo_edge *edge, ktime_t frame_end, bool *stable)
+{
+    struct servo_hot *hot = servo->hot;
+    unsigned int n = 0;
+    unsigned long width;
+    unsigned long first = ULONG_MAX;
+    bool uniform = true;
+    s64 start_in;
+    s64 fall_in = -1;
+    s64 fall_out = -1;
+    u32 rem;
+
+    // a pulse that ends in this frame, the schedule kept repeating it while
+    // the servo was not rebuilt
+    if (hot->t_fall)
+    {
+        if (ktime_before(hot->t_fall, frame_start))
+        {
+            div_u64_rem(ktime_to_ns(ktime_sub(hot->t_fall, frame_origin)), SERVO_PERIOD, &rem);
+            hot->t_fall = ktime_add_ns(frame_start, rem);
+        }
+        fall_in = ktime_to_ns(ktime_sub(hot->t_fall, frame_start));
+        edge[n].t_ns = fall_in;
+        edge[n].width = 0;
+        edge[n].idx = servo->idx;
+        edge[n].active = 0;
+        n++;
+        hot->t_fall = 0;
+    }
+
+    // only enabled pwm servos take part in the frame
+    if ((READ_ONCE(hot->state) & (BIT(SERVO_ENABLED) | SERVO_PROTO_MASK)) != BIT(SERVO_ENABLED))
+    {
+        *stable = fall_in < 0;
+        return n;
+    }
+
+    // after being disabled, or left out of rebuilds, pick the phase back up
+    // from this frame
+    if (ktime_before(hot->t_start, frame_start))
+    {
+        hot->t_phase = min_t(unsigned long, atomic_read(&(hot->phase_ns)), hot->frame_ns - hot->max_ns);
+        hot->t_start = ktime_add_ns(frame_start, hot->t_phase);
+    }
+    start_in = ktime_to_ns(ktime_sub(hot->t_start, frame_start));
+
+    while (ktime_before(hot->t_start, frame_end))
+    {
+        width = servo_next_period(servo, hot->t_start);
+        uniform &= first == ULONG_MAX || width == first;
+        first = width;
+
+        edge[n].t_ns = ktime_to_ns(ktime_sub(hot->t_start, frame_start));
+        edge[n].width = width;
+        edge[n].idx = servo->idx;
+        edge[n].active = 1;
+        n++;
+
+        if (ktime_before(ktime_add_ns(hot->t_start, width), frame_end))
+        {
+            edge[n].t_ns = edge[n - 1].t_ns + width;
+            edge[n].width = 0;
+            edge[n].idx = servo->idx;
+            edge[n].active = 0;
+            n++;
+        }
+        else
+        {
+            hot->t_fall = ktime_add_ns(hot->t_start, width);
+            fall_out = ktime_to_ns(ktime_sub(hot->t_fall, frame_end));
+        }
+
+        hot->t_start = ktime_add_ns(hot->t_start, servo_next_start(servo, width));
+    }
+
+    // the same pulses recur if they start at the same offsets with the same
+    // width, and nothing is about to move the width
+    *stable = start_in == ktime_to_ns(ktime_sub(hot->t_start, frame_end)) && fall_in == fall_out && uniform &&
+        hot->applied_ns == servo->motion_target && kfifo_is_empty(&(servo->traj));
+
+    return n;
+}
+
+// Has the consolidated scheduler rebuild a servo's edges at the next frame
+static void servo_resched(struct servo_data *servo)
+{
+    set_bit(servo->idx, edges_dirty);
+}
+
+// Stages an edge in frame_values, returns true if the output level changed
+static bool servo_fire_edge(const struct servo_edge *edge)
+{
+    struct servo_hot *hot = &(servo_hot[edge->idx]);
+    int value = edge->active ^ test_bit(SERVO_INVERTED, &(hot->state));
+    unsigned int slot = frame_slot[edge->idx];
+
+    // falling edges carry no width, the pulse keeps the one it started with
+    if (edge->active)
+    {
+        hot->t_switch = edge->width;
+    }
+    assign_bit(SERVO_ACTIVE, &(hot->state), edge->active);
+
+    if (test_bit(edge->idx, servo_values) == value)
+    {
+        return false;
+    }
+
+    assign_bit(edge->idx, servo_values, value);
+
+    // a pulse that outlasted its servo's move to another protocol ends on
+    // its own pin
+    if (slot == UINT_MAX)
+    {
+        gpiod_set_value(servos[edge->idx].gpio, value);
+        return false;
+    }
+
+    assign_bit(slot, frame_values, value);
+    return true;
+}
+
+// Writes the frame timer's outputs at once. Oneshot pulses on pins it still
+// drives update their bit in frame_values under the same lock so this never
+// undoes one. With every gpio servo on the frame the array is the one
+// acquired, so controllers can set it in a single access.
+static void servo_write_values(void)
+{
+    unsigned long flags;
+
+    if (n_frame_pins == 0)
+    {
+        return;
+    }
+
+    raw_spin_lock_irqsave(&output_lock, flags);
+    if (n_frame_pins == n_gpio_servos)
+    {
+        gpiod_set_array_value(n_frame_pins, servo_gpios->desc, servo_gpios->info, frame_values);
+    }
+    else
+    {
+        gpiod_set_array_value(n_frame_pins, frame_desc, NULL, frame_values);
+    }
+    raw_spin_unlock_irqrestore(&output_lock, flags);
+}
+
+// Restarts a stopped frame or ppm timer at its next frame on the shared grid,
+// so servos come back in phase. A running timer is kept from stopping at its
+// next check.
+static void servo_frame_wake(void)
+{
+    unsigned long period = ppm ? ppm_frame_ns : SERVO_PERIOD;
+    unsigned long flags;
+    ktime_t now;
+    ktime_t t;
+    u64 k;
+
+    raw_spin_lock_irqsave(&frame_lock, flags);
+    if (!frame_stopped)
+    {
+        frame_kick = true;
+        raw_spin_unlock_irqrestore(&frame_lock, flags);
+        return;
+    }
+
+    frame_stopped = false;
+    now = ktime_add_ns(ktime_get(), frame_margin_ns);
+    k = ktime_before(now, frame_origin) ? 0 : div_u64(ktime_to_ns(ktime_sub(now, frame_origin)), period) + 1;
+    t = ktime_add_ns(frame_origin, k*period);
+    if (ppm)
+    {
+        ppm_slot = 0;
+        ppm_active = false;
+        ppm_edge = t;
+        servo_start_timer(&ppm_remote, ktime_sub_ns(t, frame_margin_ns), 0);
+    }
+    else
+    {
+        // the first expiry rolls over into a freshly built frame
+        frame_start = ktime_sub_ns(t, SERVO_PERIOD);
+        edge_pos = n_edges;
+        servo_start_timer(&frame_remote, ktime_sub_ns(t, frame_margin_ns), 0);
+    }
+    raw_spin_unlock_irqrestore(&frame_lock, flags);
+}
+
+// Called by the frame or ppm timer with nothing to send, returns true if it
+// should stop because no servo asked for it since the last check
+static bool servo_frame_idle(void)
+{
+    unsigned long flags;
+    bool stop;
+
+    raw_spin_lock_irqsave(&frame_lock, flags);
+    stop = !frame_kick;
+    frame_stopped = stop;
+    frame_kick = false;
+    raw_spin_unlock_irqrestore(&frame_lock, flags);
+
+    return stop;
+}
+
+// Packs the pins of the servos in frame_pins for servo_write_values, called
+// from the frame timer
+static void servo_frame_pins(void)
+{
+    unsigned long flags;
+    unsigned int i;
+
+    raw_spin_lock_irqsave(&output_lock, flags);
+    n_frame_pins = 0;
+    for (i = 0; i < n_gpio_servos; i++)
+    {
+        if (!test_bit(i, frame_pins))
+        {
+            WRITE_ONCE(frame_slot[i], UINT_MAX);
+            continue;
+        }
+        WRITE_ONCE(frame_slot[i], n_frame_pins);
+        frame_desc[n_frame_pins] = servos[i].gpio;
+        assign_bit(n_frame_pins, frame_values, test_bit(i, servo_values));
+        n_frame_pins++;
+    }
+    raw_spin_unlock_irqrestore(&output_lock, flags);
+}
+
+// Drives a single output, output_lock keeps the frame timer's array write
+// from undoing it while the pin is still part of the frame
+static void servo_drive(struct servo_data *servo, int active)
+{
+    int inverted = test_bit(SERVO_INVERTED, &(servo->hot->state));
+    int value = active ? !inverted : inverted;
+    unsigned int slot;
+    unsigned long flags;
+
+    raw_spin_lock_irqsave(&output_lock, flags);
+    assign_bit(servo->idx, servo_values, value);
+    if ((slot = frame_slot[servo->idx]) != UINT_MAX)
+    {
+        assign_bit(slot, frame_values, value);
+    }
+    gpiod_set_value(servo->gpio, value);
+    raw_spin_unlock_irqrestore(&output_lock, flags);
+}
+
+// Lateness is only ever written from the single timer servicing a servo
+static void servo_record_lateness(struct servo_data *servo, ktime_t expires, ktime_t now)
+{
+    s64 late = ktime_to_ns(ktime_sub(now, expires));
+    uint32_t late_ns = late < 0 ? 0 : (late > U32_MAX ? U32_MAX : late);
+
+    u64_stats_update_begin(&(servo->lat_sync));
+    servo->lat.last_ns = late_ns;
+    if (late_ns > servo->lat.max_ns)
+    {
+        servo->lat.max_ns = late_ns;
+    }
+    servo->lat.total_ns += late_ns;
+    servo->lat.count++;
+    servo->lat.cpu = raw_smp_processor_id();
+    u64_stats_update_end(&(servo->lat_sync));
+}
+
+static void servo_record_spin(struct servo_data *servo, u64 spin_ns, unsigned long margin_ns)
+{
+    u64_stats_update_begin(&(servo->lat_sync));
+    servo->lat.spin_ns += spin_ns;
+    servo->lat.margin_ns = margin_ns;
+    u64_stats_update_end(&(servo->lat_sync));
+}
+
+// Histogram bucket k >= 1 covers [2^(HIST_SHIFT+k-1), 2^(HIST_SHIFT+k)) ns
+static unsigned int servo_hist_bucket(s64 ns)
+{
+    if (ns <= 0)
+    {
+        return 0;
+    }
+
+    return min_t(unsigned int, fls64((u64)ns >> HIST_SHIFT), HIST_BUCKETS - 1);
+}
+
+// Called from the timer servicing the servo with the time an edge was due
+// and the time it was driven
+static void servo_record_edge(struct servo_data *servo, int active, ktime_t due, ktime_t actual)
+{
+    s64 late = ktime_to_ns(ktime_sub(actual, due));
+    s64 err;
+
+    u64_stats_update_begin(&(servo->hist.sync));
+    if (active)
+    {
+        servo->hist.rise[servo_hist_bucket(late)]++;
+        if (late >= (s64)servo->hot->t_switch)
+        {
+            servo->hist.missed++;
+        }
+        servo->t_rise = actual;
+    }
+    else
+    {
+        servo->hist.fall[servo_hist_bucket(late)]++;
+
+        err = ktime_to_ns(ktime_sub(actual, servo->t_rise)) - servo->hot->t_switch;
+        if (servo->hist.err_count == 0 || err < servo->hist.err_min)
+        {
+            servo->hist.err_min = err;
+        }
+        if (servo->hist.err_count == 0 || err > servo->hist.err_max)
+        {
+            servo->hist.err_max = err;
+        }
+        servo->hist.err_total += err;
+        servo->hist.err_count++;
+    }
+    u64_stats_update_end(&(servo->hist.sync));
+}
+
+static void servo_record_exec(struct servo_hist *hist, ktime_t start, ktime_t end, ktime_t next)
+{
+    u64_stats_update_begin(&(hist->sync));
+    hist->exec[servo_hist_bucket(ktime_to_ns(ktime_sub(end, start)))]++;
+    if (ktime_after(end, next))
+    {
+        hist->overruns++;
+    }
+    u64_stats_update_end(&(hist->sync));
+}
+
+static void servo_record_coalesced(struct servo_hist *hist)
+{
+    u64_stats_update_begin(&(hist->sync));
+    hist->coalesced++;
+    u64_stats_update_end(&(hist->sync));
+}
+
+// Tracks a decaying peak of the observed lateness so the timer fires early
+// enough to cover its wakeup latency without spinning longer than needed
+static unsigned long servo_calibrate_margin(unsigned long margin_ns, ktime_t expires, ktime_t now)
+{
+    s64 late = ktime_to_ns(ktime_sub(now, expires));
+
+    if (late + SPIN_MARGIN_GUARD > (s64)margin_ns)
+    {
+        margin_ns = late + SPIN_MARGIN_GUARD;
+    }
+    else
+    {
+        margin_ns -= margin_ns >> SPIN_MARGIN_DECAY;
+    }
+
+    return clamp_t(unsigned long, margin_ns, SPIN_MARGIN_MIN, SPIN_MARGIN_MAX);
+}
+
+// Busy-waits until t, returns the time spent spinning
+static u64 servo_spin_until(ktime_t t)
+{
+    ktime_t start = ktime_get();
+    ktime_t now = start;
+
+    while (ktime_before(now, t))
+    {
+        cpu_relax();
+        now = ktime_get();
+    }
+
+    return ktime_to_ns(ktime_sub(now, start));
+}
+
+int servo_open(struct inode *inodep, struct file *filp)
+{
+    unsigned int idx = MINOR(inodep->i_rdev);
+
+    mutex_lock(&ctl_lock);
+    if (test_bit(SERVO_OPEN, &(servos[idx].hot->state)) || test_bit(idx, servo_claimed))
+    {
+        mutex_unlock(&ctl_lock);
+        pr_warn("servos: [ERROR] A process tried to open servo %d when it was already opened or claimed.\n", idx);
+        return -1;
+    }
+
+    servos[idx].wake_seen = atomic_read(&(servos[idx].wake_seq));
+    set_bit(SERVO_OPEN, &(servos[idx].hot->state));
+    mutex_unlock(&ctl_lock);
+    servo_pwm_update(&(servos[idx]));
+    filp->private_data = (void *) &(servos[idx]);
+    return 0;
+}
+
+int servo_release(struct inode *inodep, struct file *filp)
+{
+    unsigned int idx = MINOR(inodep->i_rdev);
+    servo_fasync(-1, filp, 0);
+    servo_enable(&(servos[idx]), false);
+    clear_bit(SERVO_OPEN, &(servos[idx].hot->state));
+    return 0;
+}
+
+ssize_t servo_read(struct file *filp, char __user *buf, size_t len, loff_t *off)
+{
+    struct servo_data *servo = (struct servo_data *)(filp->private_data);
+    unsigned int period_ns = atomic_read(&(servo->hot->period_ns));
+    unsigned char kbuf[16];
+    size_t klen;
+    size_t min;
+
+    // reading acknowledges the last frame notification
+    servo->wake_seen = atomic_read(&(servo->wake_seq));
+
+    if (*off > 0)
+    {
+        return 0;
+    }
+
+    klen = snprintf(kbuf, 16, "%u\n", period_ns);
+
+    min = len < klen ? len : klen;
+
+    if (copy_to_user(buf, kbuf, min))
+    {
+        pr_err("servos: [ERROR] Could not write to output buffer.\n");
+        return 0;
+    }
+
+    *off += min;
+    return min;
+}
+
+ssize_t servo_write(struct file *filp, const char __user *buf, size_t len, loff_t *off)
+{
+    struct servo_data *servo = (struct servo_data *)(filp->private_data);
+    unsigned int period_ns;
+    unsigned char kbuf[16];
+    size_t klen = len < 15 ? len : 15;
+
+    if (copy_from_user(kbuf, buf, klen))
+    {
+        pr_err("servos: [ERROR] Could not read from input buffer.\n");
+        return 0;
+    }
+
+    if (klen >= sizeof(uint32_t) && *((uint32_t *)kbuf) == RECORD_MAGIC)
+    {
+        return servo_write_records(servo, buf, len);
+    }
+
+    kbuf[klen] = '\0';
+    if (sscanf(kbuf, "%u\n", &period_ns) != 1)
+    {
+        atomic_inc(&(servo->bad_input));
+        return klen;
+    }
+
+    servo_set_period(servo, servo_clamp_period(servo, period_ns), SETPOINT_WRITE);
+
+    return klen;
+}
+
+// Applies a binary write(), records are copied in small chunks so any number
+// of servos can be updated in one call without allocating. Records for servos
+// opened or claimed by someone else are skipped and counted like unknown ones.
+static ssize_t servo_write_records(struct servo_data *servo, const char __user *buf, size_t len)
+{
+    struct servo_records hdr;
+    struct servo_setpoint records[RECORD_CHUNK];
+    size_t done;
+    size_t n;
+    size_t i;
+
+    if (len < sizeof(hdr))
+    {
+        atomic_inc(&(servo->bad_input));
+        return -EINVAL;
+    }
+    if (copy_from_user(&hdr, buf, sizeof(hdr)))
+    {
+        return -EFAULT;
+    }
+    if (hdr.count > (len - sizeof(hdr))/sizeof(struct servo_setpoint))
+    {
+        atomic_inc(&(servo->bad_input));
+        return -EINVAL;
+    }
+
+    buf += sizeof(hdr);
+    mutex_lock(&ctl_lock);
+    for (done = 0; done < hdr.count; done += n)
+    {
+        n = min_t(size_t, hdr.count - done, RECORD_CHUNK);
+        if (copy_from_user(records, buf + done*sizeof(struct servo_setpoint), n*sizeof(struct servo_setpoint)))
+        {
+            mutex_unlock(&ctl_lock);
+            return -EFAULT;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            if (records[i].idx >= n_servos || !servo_may_write(servo, records[i].idx))
+            {
+                atomic_inc(&(servo->bad_input));
+                continue;
+            }
+            servo_set_period(&(servos[records[i].idx]), servo_clamp_period(&(servos[records[i].idx]), records[i].period_ns), SETPOINT_WRITE);
+        }
+    }
+    mutex_unlock(&ctl_lock);
+
+    return sizeof(hdr) + hdr.count*sizeof(struct servo_setpoint);
+}
+
+long servo_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct servo_data *servo = (struct servo_data *)(filp->private_data);
+    unsigned int new_value = 0;
+    struct servo_lateness lat;
+    struct servo_counters counters;
+    struct servo_limits limits;
+    struct servo_motion motion;
+    unsigned long flags;
+    unsigned int start;
+    int success = 0;
+
+    switch (cmd)
+    {
+    case SERVO_ENB:
+        servo_enable(servo, true);
+        break;
+    case SERVO_DIS:
+        servo_enable(servo, false);
+        break;
+    case SERVO_INV:
+        change_bit(SERVO_INVERTED, &(servo->hot->state));
+        servo_pwm_update(servo);
+        break;
+    case SERVO_WF:
+        if (copy_from_user(&new_value, (uint32_t *)arg, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d received new flags, but could not apply them.\n", servo->idx);
+            success = -1;
+            break;
+        }
+        servo_write_flags(servo, new_value);
+        break;
+    case SERVO_RF:
+        new_value = servo_read_flags(servo);
+        if (copy_to_user((uint32_t *)arg, &new_value, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d was asked for flags, but could not supply them.\n", servo->idx);
+            success = -2;
+        }
+        break;
+    case SERVO_WV:
+        if (copy_from_user(&new_value, (uint32_t *)arg, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d received new value, but could not apply them.\n", servo->idx);
+            success = -3;
+            break;
+        }
+        servo_set_period(servo, servo_clamp_period(servo, new_value), SETPOINT_IOCTL);
+        break;
+    case SERVO_RV:
+        new_value = atomic_read(&(servo->hot->period_ns));
+
+        if (copy_to_user((uint32_t *)arg, &new_value, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d was asked to for value, but could not supply it.\n", servo->idx);
+            success = -4;
+        }
+        break;
+    case SERVO_WP:
+        if (copy_from_user(&new_value, (uint32_t *)arg, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d received new phase, but could not apply it.\n", servo->idx);
+            success = -EFAULT;
+            break;
+        }
+        if (new_value > READ_ONCE(servo->limits.frame_ns) - READ_ONCE(servo->limits.max_ns))
+        {
+            atomic_inc(&(servo->phase_clamped));
+            new_value = READ_ONCE(servo->limits.frame_ns) - READ_ONCE(servo->limits.max_ns);
+        }
+        atomic_set(&(servo->hot->phase_ns), new_value);
+        servo_resched(servo);
+        break;
+    case SERVO_RP:
+        new_value = atomic_read(&(servo->hot->phase_ns));
+
+        if (copy_to_user((uint32_t *)arg, &new_value, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d was asked for phase, but could not supply it.\n", servo->idx);
+            success = -EFAULT;
+        }
+        break;
+    case SERVO_RL:
+        do
+        {
+            start = u64_stats_fetch_begin(&(servo->lat_sync));
+            lat = servo->lat;
+        } while (u64_stats_fetch_retry(&(servo->lat_sync), start));
+
+        if (copy_to_user((struct servo_lateness *)arg, &lat, sizeof(lat)))
+        {
+            pr_err("servos: [ERROR] Servo %d was asked for lateness, but could not supply it.\n", servo->idx);
+            success = -EFAULT;
+        }
+        break;
+    case SERVO_WC:
+        success = servo_stage_commit(servo, (struct servo_commit __user *)arg);
+        break;
+    case SERVO_WT:
+        success = servo_queue_trajectory(servo, (struct servo_trajectory __user *)arg);
+        break;
+    case SERVO_CT:
+        // the queue is flushed by its consumer at the next pulse
+        set_bit(SERVO_FLUSH, &(servo->hot->state));
+        servo_resched(servo);
+        break;
+    case SERVO_WW:
+        if (copy_from_user(&new_value, (uint32_t *)arg, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d received new wake lead, but could not apply it.\n", servo->idx);
+            success = -EFAULT;
+            break;
+        }
+        atomic_set(&(servo->wake_lead_ns), min_t(unsigned int, new_value, MAX_PHASE));
+        break;
+    case SERVO_RW:
+        new_value = atomic_read(&(servo->wake_lead_ns));
+
+        if (copy_to_user((uint32_t *)arg, &new_value, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d was asked for wake lead, but could not supply it.\n", servo->idx);
+            success = -EFAULT;
+        }
+        break;
+    case SERVO_RC:
+        counters.below_min = atomic_read(&(servo->below_min));
+        counters.above_max = atomic_read(&(servo->above_max));
+        counters.phase_clamped = atomic_read(&(servo->phase_clamped));
+        counters.bad_input = atomic_read(&(servo->bad_input));
+
+        if (copy_to_user((struct servo_counters *)arg, &counters, sizeof(counters)))
+        {
+            pr_err("servos: [ERROR] Servo %d was asked for counters, but could not supply them.\n", servo->idx);
+            success = -EFAULT;
+        }
+        break;
+    case SERVO_WM:
+        if (copy_from_user(&limits, (struct servo_limits *)arg, sizeof(limits)))
+        {
+            pr_err("servos: [ERROR] Servo %d received new limits, but could not apply them.\n", servo->idx);
+            success = -EFAULT;
+            break;
+        }
+        if (servo_check_limits(&limits, servo_proto(servo->hot)))
+        {
+            atomic_inc(&(servo->bad_input));
+            success = -EINVAL;
+            break;
+        }
+        servo_set_limits(servo, &limits);
+        break;
+    case SERVO_RM:
+        raw_spin_lock_irqsave(&limits_lock, flags);
+        limits = servo->limits;
+        raw_spin_unlock_irqrestore(&limits_lock, flags);
+
+        if (copy_to_user((struct servo_limits *)arg, &limits, sizeof(limits)))
+        {
+            pr_err("servos: [ERROR] Servo %d was asked for limits, but could not supply them.\n", servo->idx);
+            success = -EFAULT;
+        }
+        break;
+    case SERVO_WO:
+        if (copy_from_user(&new_value, (uint32_t *)arg, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d received new protocol, but could not apply it.\n", servo->idx);
+            success = -EFAULT;
+            break;
+        }
+        if (new_value >= N_PROTOS || ((ppm || servo->pwm) && new_value != PROTO_PWM))
+        {
+            atomic_inc(&(servo->bad_input));
+            success = -EINVAL;
+            break;
+        }
+        servo_set_proto(servo, new_value);
+        break;
+    case SERVO_RO:
+        new_value = servo_proto(servo->hot);
+
+        if (copy_to_user((uint32_t *)arg, &new_value, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d was asked for protocol, but could not supply it.\n", servo->idx);
+            success = -EFAULT;
+        }
+        break;
+    case SERVO_WS:
+        if (copy_from_user(&motion, (struct servo_motion *)arg, sizeof(motion)))
+        {
+            pr_err("servos: [ERROR] Servo %d received new motion settings, but could not apply them.\n", servo->idx);
+            success = -EFAULT;
+            break;
+        }
+        if (motion.interp >= N_INTERPS)
+        {
+            atomic_inc(&(servo->bad_input));
+            success = -EINVAL;
+            break;
+        }
+        atomic_set(&(servo->slew_ns), motion.slew_ns);
+        atomic_set(&(servo->interp), motion.interp);
+        atomic_set(&(servo->interp_ns), motion.interp_ns);
+        break;
+    case SERVO_RS:
+        motion.slew_ns = atomic_read(&(servo->slew_ns));
+        motion.interp = atomic_read(&(servo->interp));
+        motion.interp_ns = atomic_read(&(servo->interp_ns));
+        motion.reserved = 0;
+
+        if (copy_to_user((struct servo_motion *)arg, &motion, sizeof(motion)))
+        {
+            pr_err("servos: [ERROR] Servo %d was asked for motion settings, but could not supply them.\n", servo->idx);
+            success = -EFAULT;
+        }
+        break;
+    case SERVO_WA:
+        if (copy_from_user(&new_value, (uint32_t *)arg, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d received new precision class, but could not apply it.\n", servo->idx);
+            success = -EFAULT;
+            break;
+        }
+        if (new_value >= N_CLASSES)
+        {
+            atomic_inc(&(servo->bad_input));
+            success = -EINVAL;
+            break;
+        }
+        servo_set_precision(servo, new_value);
+        break;
+    case SERVO_RA:
+        new_value = servo_precision(servo->hot);
+
+        if (copy_to_user((uint32_t *)arg, &new_value, sizeof(new_value)))
+        {
+            pr_err("servos: [ERROR] Servo %d was asked for precision class, but could not supply it.\n", servo->idx);
+            success = -EFAULT;
+        }
+        break;
+    default:
+        pr_warn("servos: [WARN] Servo %d received unknown IOCTL command %d.\n", servo->idx, cmd);
+        success = -5;
+        break;
+    }
+
+    trace_servo_ioctl(servo->idx, cmd, arg, success);
+
+    return success;
+}
+
+// Applies the user visible flags of SERVO_WF
+static void servo_write_flags(struct servo_data *servo, uint32_t flags)
+{
+    assign_bit(SERVO_INVERTED, &(servo->hot->state), flags & (1 << SERVO_INVERTED));
+    servo_enable(servo, flags & (1 << SERVO_ENABLED));
+}
+
+static uint32_t servo_read_flags(struct servo_data *servo)
+{
+    return READ_ONCE(servo->hot->state) & ((1 << SERVO_ENABLED) | (1 << SERVO_INVERTED));
+}
+
+// A servo file may set its own servo and any servo nobody else opened or
+// claimed, called under ctl_lock
+static bool servo_may_write(const struct servo_data *servo, unsigned int idx)
+{
+    return idx == servo->idx || !(test_bit(SERVO_OPEN, &(servos[idx].hot->state)) || test_bit(idx, servo_claimed));
+}
+
+static bool servo_may_write_all(const struct servo_data *servo, const struct servo_setpoint *setpoints, uint32_t count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (!servo_may_write(servo, setpoints[i].idx))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Frame in which a setpoint written now first reaches the output
+static u64 servo_effect_frame(struct servo_data *servo)
+{
+    unsigned long state = READ_ONCE(servo->hot->state);
+    ktime_t t_rise;
+
+    // oneshot and dshot pulses go out straight away, the frame timers build
+    // their pulses at the boundary so the current frame is already fixed
+    if (state & SERVO_PROTO_MASK)
+    {
+        return servo_frame_index(ktime_get());
+    }
+    if (consolidated || ppm || servo->pwm)
+    {
+        return servo_frame_index(ktime_get()) + 1;
+    }
+
+    // per servo timers pick the setpoint up at the next rising edge
+    t_rise = READ_ONCE(servo->t_edge);
+    if (state & BIT(SERVO_ACTIVE))
+    {
+        t_rise = ktime_add_ns(t_rise, READ_ONCE(servo->hot->t_next));
+    }
+
+    return servo_frame_index(t_rise);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+// Reads complete inline with the value as the cqe result. Writes are queued
+// one frame apart per servo in submission order and complete once applied,
+// with the frame they took effect in as the cqe result.
+int servo_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct servo_data *servo = (struct servo_data *)(ioucmd->file->private_data);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+    const uint32_t *value = io_uring_sqe_cmd(ioucmd->sqe);
+#else
+    const uint32_t *value = ioucmd->cmd;
+#endif
+    int success;
+
+    switch (ioucmd->cmd_op)
+    {
+    case SERVO_URING_WV:
+    case SERVO_URING_WF:
+    case SERVO_URING_WC:
+        success = servo_uring_queue(servo, ioucmd, value, issue_flags);
+        break;
+    case SERVO_URING_RV:
+        success = atomic_read(&(servo->hot->period_ns));
+        break;
+    case SERVO_URING_RF:
+        success = servo_read_flags(servo);
+        break;
+    default:
+        success = -ENOTTY;
+        break;
+    }
+
+    trace_servo_ioctl(servo->idx, ioucmd->cmd_op, *value, success);
+
+    return success;
+}
+
+// Copies a write out of the sqe and queues it for the servo's next free
+// frame. Commits copy and check their setpoints, which may sleep, so they
+// are retried from a worker when io_uring issues them nonblocking.
+static int servo_uring_queue(struct servo_data *servo, struct io_uring_cmd *ioucmd, const void *arg, unsigned int issue_flags)
+{
+    const struct servo_uring_commit *commit = arg;
+    bool nonblock = issue_flags & IO_URING_F_NONBLOCK;
+    struct servo_uring_entry *entry;
+    unsigned long flags;
+    int success = -EIOCBQUEUED;
+
+    if (ioucmd->cmd_op == SERVO_URING_WC && nonblock)
+    {
+        return -EAGAIN;
+    }
+    if ((entry = kzalloc(sizeof(struct servo_uring_entry), nonblock ? GFP_NOWAIT : GFP_KERNEL)) == NULL)
+    {
+        return nonblock ? -EAGAIN : -ENOMEM;
+    }
+    entry->ioucmd = ioucmd;
+    entry->servo = servo;
+    entry->op = ioucmd->cmd_op;
+
+    if (entry->op == SERVO_URING_WC)
+    {
+        if (IS_ERR(entry->setpoints = servo_copy_setpoints(commit->count, commit->setpoints)))
+        {
+            success = PTR_ERR(entry->setpoints);
+            kfree(entry);
+            return success;
+        }
+        entry->count = commit->count;
+
+        // ownership is checked when queued, as for commits staged by ioctl
+        mutex_lock(&ctl_lock);
+        if (!servo_may_write_all(servo, entry->setpoints, entry->count))
+        {
+            success = -EACCES;
+        }
+    }
+    else
+    {
+        entry->value = *(const uint32_t *)arg;
+    }
+
+    if (success == -EIOCBQUEUED)
+    {
+        raw_spin_lock_irqsave(&commit_lock, flags);
+        if (servo->uring_queued < URING_DEPTH)
+        {
+            entry->frame = max(servo_frame_index(ktime_add_ns(ktime_get(), COMMIT_LEAD)) + 1, servo->uring_frame + 1);
+            servo->uring_frame = entry->frame;
+            servo->uring_queued++;
+            ((struct servo_uring_pdu *)ioucmd->pdu)->entry = entry;
+            list_add_tail(&(entry->node), &uring_queue);
+            servo_commit_wake();
+        }
+        else
+        {
+            success = -EBUSY;
+        }
+        raw_spin_unlock_irqrestore(&commit_lock, flags);
+    }
+
+    if (entry->op == SERVO_URING_WC)
+    {
+        mutex_unlock(&ctl_lock);
+    }
+    if (success != -EIOCBQUEUED)
+    {
+        kfree(entry->setpoints);
+        kfree(entry);
+    }
+
+    return success;
+}
+
+// Applies the queued writes due by frame and hands them to io_uring for
+// completion, called from the commit timer ahead of the frame boundary
+static void servo_uring_apply(u64 frame)
+{
+    struct servo_uring_entry *entry;
+    struct servo_uring_entry *next;
+    struct servo_data *servo;
+    unsigned long flags;
+    unsigned int i;
+    LIST_HEAD(due);
+
+    raw_spin_lock_irqsave(&commit_lock, flags);
+    list_for_each_entry_safe(entry, next, &uring_queue, node)
+    {
+        if (entry->frame <= frame)
+        {
+            entry->servo->uring_queued--;
+            list_move_tail(&(entry->node), &due);
+        }
+    }
+    raw_spin_unlock_irqrestore(&commit_lock, flags);
+
+    list_for_each_entry_safe(entry, next, &due, node)
+    {
+        switch (entry->op)
+        {
+        case SERVO_URING_WV:
+            servo_set_period(entry->servo, servo_clamp_period(entry->servo, entry->value), SETPOINT_IOCTL);
+            entry->result = servo_effect_frame(entry->servo) & INT_MAX;
+            break;
+        case SERVO_URING_WF:
+            servo_write_flags(entry->servo, entry->value);
+            entry->result = servo_effect_frame(entry->servo) & INT_MAX;
+            break;
+        case SERVO_URING_WC:
+            // every servo of the commit picks its setpoint up at this boundary
+            for (i = 0; i < entry->count; i++)
+            {
+                servo = &(servos[entry->setpoints[i].idx]);
+                servo_set_period(servo, servo_clamp_period(servo, entry->setpoints[i].period_ns), SETPOINT_COMMIT);
+            }
+            entry->result = frame & INT_MAX;
+            break;
+        }
+        list_del(&(entry->node));
+        io_uring_cmd_complete_in_task(entry->ioucmd, servo_uring_done);
+    }
+}
+
+// Posts the cqe from the submitter's task, the timer cannot
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+static void servo_uring_done(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+#else
+static void servo_uring_done(struct io_uring_cmd *ioucmd)
+#endif
+{
+    struct servo_uring_entry *entry = ((struct servo_uring_pdu *)ioucmd->pdu)->entry;
+    int result = entry->result;
+
+    kfree(entry->setpoints);
+    kfree(entry);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    io_uring_cmd_done(ioucmd, result, 0, issue_flags);
+#else
+    io_uring_cmd_done(ioucmd, result, 0);
+#endif
+}
+#endif
+
+// The whole page may be mapped through a servo file, but only the word of
+// the servo it opened takes effect
+int servo_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    int success;
+
+    if ((success = servo_map_shm(vma, &servo_shm_ops)) == 0)
+    {
+        servo_shm_open(vma);
+    }
+
+    return success;
+}
+
+static int servo_map_shm(struct vm_area_struct *vma, const struct vm_operations_struct *ops)
+{
+    int success;
+
+    if (vma->vm_pgoff != 0)
+    {
+        pr_warn("servos: [WARN] Shared setpoints can only be mapped from offset 0.\n");
+        return -EINVAL;
+    }
+
+    if ((success = remap_vmalloc_range(vma, servo_shm, 0)) == 0)
+    {
+        vma->vm_ops = ops;
+    }
+
+    return success;
+}
+
+// Mappings of the shared page are counted so the consolidated scheduler only
+// scans it while someone may be storing setpoints there, and per servo so
+// only words whose owner has the page mapped take effect. The mapping holds
+// the file, so the owner stays the same until it is unmapped.
+static void servo_shm_open(struct vm_area_struct *vma)
+{
+    unsigned long flags;
+
+    atomic_inc(&shm_maps);
+    spin_lock_irqsave(&shm_lock, flags);
+    servo_shm_cover((struct servo_data *)(vma->vm_file->private_data), 1);
+    spin_unlock_irqrestore(&shm_lock, flags);
+}
+
+static void servo_shm_close(struct vm_area_struct *vma)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&shm_lock, flags);
+    servo_shm_cover((struct servo_data *)(vma->vm_file->private_data), -1);
+    spin_unlock_irqrestore(&shm_lock, flags);
+    atomic_dec(&shm_maps);
+}
+
+// Adds to the mappings a servo's word is honoured for, called under shm_lock.
+// Whatever others stored in the word while it was ignored is dropped when
+// the owner maps the page.
+static void servo_shm_cover(struct servo_data *servo, int maps)
+{
+    if (maps > 0 && atomic_read(&(servo->shm_maps)) == 0)
+    {
+        WRITE_ONCE(servo_shm[servo->idx], READ_ONCE(servo->hot->shm_seen));
+    }
+    atomic_add(maps, &(servo->shm_maps));
+
+    // a hardware pwm servo only watches the word while it is mapped
+    servo_pwm_update(servo);
+}
+
+// Readable once a frame notification arrived that has not been acknowledged
+// by a read() yet
+__poll_t servo_poll(struct file *filp, poll_table *wait)
+{
+    struct servo_data *servo = (struct servo_data *)(filp->private_data);
+
+    poll_wait(filp, &(servo->wait), wait);
+
+    if (atomic_read(&(servo->wake_seq)) != servo->wake_seen)
+    {
+        return EPOLLIN | EPOLLRDNORM;
+    }
+
+    return 0;
+}
+
+int servo_fasync(int fd, struct file *filp, int on)
+{
+    struct servo_data *servo = (struct servo_data *)(filp->private_data);
+
+    return fasync_helper(fd, filp, on, &(servo->fasync));
+}
+
+// One stats file per servo plus one for the consolidated frame timer, whose
+// histogram only holds callback execution times
+static void servo_init_debugfs(void)
+{
+    char name[16];
+    unsigned int i;
+
+    servo_debugfs = debugfs_create_dir("servos", NULL);
+
+    for (i = 0; i < n_servos; i++)
+    {
+        snprintf(name, sizeof(name), "servo%d", i);
+        debugfs_create_file(name, 0444, servo_debugfs, &(servos[i].hist), &servo_stats_fops);
+    }
+    debugfs_create_file("frame", 0444, servo_debugfs, &frame_hist, &servo_stats_fops);
+}
+
+static int servo_stats_show(struct seq_file *seq, void *unused)
+{
+    struct servo_hist *hist = seq->private;
+    struct servo_hist snap;
+    unsigned int start;
+    unsigned int i;
+
+    do
+    {
+        start = u64_stats_fetch_begin(&(hist->sync));
+        memcpy(&snap, hist, offsetof(struct servo_hist, sync));
+    } while (u64_stats_fetch_retry(&(hist->sync), start));
+
+    seq_printf(seq, "%12s %12s %12s %12s\n", "below_ns", "rise", "fall", "exec");
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        if (i < HIST_BUCKETS - 1)
+        {
+            seq_printf(seq, "%12llu", 1ULL << (HIST_SHIFT + i));
+        }
+        else
+        {
+            seq_printf(seq, "%12s", "inf");
+        }
+        seq_printf(seq, " %12llu %12llu %12llu\n", snap.rise[i], snap.fall[i], snap.exec[i]);
+    }
+
+    if (snap.err_count > 0)
+    {
+        seq_printf(seq, "pulse_error_ns: min %lld max %lld mean %lld\n", snap.err_min, snap.err_max, div64_s64(snap.err_total, snap.err_count));
+    }
+    seq_printf(seq, "missed: %llu\n", snap.missed);
+    seq_printf(seq, "overruns: %llu\n", snap.overruns);
+    seq_printf(seq, "interrupts_saved: %llu\n", snap.coalesced);
+    if (hist != &frame_hist)
+    {
+        seq_printf(seq, "cpu: %d\n", (int)READ_ONCE(container_of(hist, struct servo_data, hist)->lat.cpu));
+    }
+
+    return 0;
+}
+
+// Any number of processes may open the control device, each claims the
+// servos it drives
+int servo_ctl_open(struct inode *inodep, struct file *filp)
+{
+    struct servo_client *client;
+
+    if ((client = kzalloc(sizeof(struct servo_client), GFP_KERNEL)) == NULL)
+    {
+        return -ENOMEM;
+    }
+    if ((client->owned = bitmap_zalloc(n_servos, GFP_KERNEL)) == NULL)
+    {
+        kfree(client);
+        return -ENOMEM;
+    }
+
+    filp->private_data = (void *) client;
+    return 0;
+}
+
+int servo_ctl_release(struct inode *inodep, struct file *filp)
+{
+    struct servo_client *client = (struct servo_client *)(filp->private_data);
+    unsigned int i;
+
+    // servos left behind stop with their owner
+    mutex_lock(&ctl_lock);
+    for_each_set_bit(i, client->owned, n_servos)
+    {
+        servo_enable(&(servos[i]), false);
+    }
+    bitmap_andnot(servo_claimed, servo_claimed, client->owned, n_servos);
+    mutex_unlock(&ctl_lock);
+
+    bitmap_free(client->owned);
+    kfree(client);
+    return 0;
+}
+
+long servo_ctl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct servo_client *client = (struct servo_client *)(filp->private_data);
+    unsigned long *mask;
+    unsigned long flags;
+    unsigned int i;
+    long success = 0;
+
+    switch (cmd)
+    {
+    case SERVO_CTL_WV:
+    case SERVO_CTL_RV:
+        success = servo_ctl_values(client, (struct servo_values __user *)arg, cmd == SERVO_CTL_WV);
+        trace_servo_ioctl(n_servos, cmd, arg, success);
+        return success;
+    case SERVO_CTL_CLAIM:
+    case SERVO_CTL_FREE:
+    case SERVO_CTL_ENB:
+    case SERVO_CTL_DIS:
+    case SERVO_CTL_INV:
+        break;
+    default:
+        return -ENOTTY;
+    }
+
+    if ((mask = bitmap_zalloc(n_servos, GFP_KERNEL)) == NULL)
+    {
+        return -ENOMEM;
+    }
+    if ((success = servo_ctl_mask((struct servo_mask __user *)arg, mask)))
+    {
+        bitmap_free(mask);
+        return success;
+    }
+
+    // claims and the servos they cover only change under ctl_lock
+    mutex_lock(&ctl_lock);
+    if (cmd == SERVO_CTL_CLAIM)
+    {
+        for_each_set_bit(i, mask, n_servos)
+        {
+            if (test_bit(i, servo_claimed) || test_bit(SERVO_OPEN, &(servos[i].hot->state)))
+            {
+                success = -EBUSY;
+            }
+        }
+        if (!success)
+        {
+            bitmap_or(servo_claimed, servo_claimed, mask, n_servos);
+            spin_lock_irqsave(&shm_lock, flags);
+            bitmap_or(client->owned, client->owned, mask, n_servos);
+            servo_ctl_shm_cover(mask, client->shm_maps);
+            spin_unlock_irqrestore(&shm_lock, flags);
+        }
+    }
+    else if (cmd == SERVO_CTL_FREE)
+    {
+        bitmap_and(mask, mask, client->owned, n_servos);
+        bitmap_andnot(servo_claimed, servo_claimed, mask, n_servos);
+        spin_lock_irqsave(&shm_lock, flags);
+        bitmap_andnot(client->owned, client->owned, mask, n_servos);
+        servo_ctl_shm_cover(mask, -(int)client->shm_maps);
+        spin_unlock_irqrestore(&shm_lock, flags);
+    }
+    else if (!bitmap_subset(mask, client->owned, n_servos))
+    {
+        success = -EACCES;
+    }
+    else
+    {
+        for_each_set_bit(i, mask, n_servos)
+        {
+            switch (cmd)
+            {
+            case SERVO_CTL_ENB:
+                servo_enable(&(servos[i]), true);
+                break;
+            case SERVO_CTL_DIS:
+                servo_enable(&(servos[i]), false);
+                break;
+            case SERVO_CTL_INV:
+                change_bit(SERVO_INVERTED, &(servos[i].hot->state));
+                servo_pwm_update(&(servos[i]));
+                break;
+            }
+        }
+    }
+    mutex_unlock(&ctl_lock);
+
+    bitmap_free(mask);
+    trace_servo_ioctl(n_servos, cmd, arg, success);
+
+    return success;
+}
+
+// The shared page mapped through the control device carries the setpoints
+// of the servos the client claims, claims made later are included
+int servo_ctl_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    int success;
+
+    if ((success = servo_map_shm(vma, &servo_ctl_shm_ops)) == 0)
+    {
+        servo_ctl_shm_open(vma);
+    }
+
+    return success;
+}
+
+static void servo_ctl_shm_open(struct vm_area_struct *vma)
+{
+    struct servo_client *client = (struct servo_client *)(vma->vm_file->private_data);
+    unsigned long flags;
+
+    atomic_inc(&shm_maps);
+    spin_lock_irqsave(&shm_lock, flags);
+    client->shm_maps++;
+    servo_ctl_shm_cover(client->owned, 1);
+    spin_unlock_irqrestore(&shm_lock, flags);
+}
+
+static void servo_ctl_shm_close(struct vm_area_struct *vma)
+{
+    struct servo_client *client = (struct servo_client *)(vma->vm_file->private_data);
+    unsigned long flags;
+
+    spin_lock_irqsave(&shm_lock, flags);
+    client->shm_maps--;
+    servo_ctl_shm_cover(client->owned, -1);
+    spin_unlock_irqrestore(&shm_lock, flags);
+    atomic_dec(&shm_maps);
+}
+
+// Adds maps mappings to every servo in mask, called under shm_lock together
+// with any change to the client's servos
+static void servo_ctl_shm_cover(const unsigned long *mask, int maps)
+{
+    unsigned int i;
+
+    if (maps == 0)
+    {
+        return;
+    }
+
+    for_each_set_bit(i, mask, n_servos)
+    {
+        servo_shm_cover(&(servos[i]), maps);
+    }
+}
+
+// Reads a user supplied servo mask, bits past the last servo are rejected
+static long servo_ctl_mask(struct servo_mask __user *arg, unsigned long *mask)
+{
+    struct servo_mask hdr;
+    uint32_t *words;
+
+    if (copy_from_user(&hdr, arg, sizeof(hdr)))
+    {
+        return -EFAULT;
+    }
+    if (hdr.n_bits == 0 || hdr.n_bits > n_servos)
+    {
+        return -EINVAL;
+    }
+    if ((words = kmalloc_array(DIV_ROUND_UP(hdr.n_bits, 32), sizeof(uint32_t), GFP_KERNEL)) == NULL)
+    {
+        return -ENOMEM;
+    }
+    if (copy_from_user(words, u64_to_user_ptr(hdr.bits), DIV_ROUND_UP(hdr.n_bits, 32)*sizeof(uint32_t)))
+    {
+        kfree(words);
+        return -EFAULT;
+    }
+
+    bitmap_from_arr32(mask, words, hdr.n_bits);
+    kfree(words);
+
+    return 0;
+}
+
+// Writes setpoints to claimed servos, or reads any servo's setpoint back into
+// the records
+static long servo_ctl_values(struct servo_client *client, struct servo_values __user *arg, bool write)
+{
+    struct servo_values values;
+    struct servo_setpoint *setpoints;
+    long success = 0;
+    unsigned int i;
+
+    if (copy_from_user(&values, arg, sizeof(values)))
+    {
+        return -EFAULT;
+    }
+    if (values.count == 0 || values.count > n_servos)
+    {
+        return -EINVAL;
+    }
+    if ((setpoints = kmalloc_array(values.count, sizeof(struct servo_setpoint), GFP_KERNEL)) == NULL)
+    {
+        return -ENOMEM;
+    }
+    if (copy_from_user(setpoints, u64_to_user_ptr(values.setpoints), values.count*sizeof(struct servo_setpoint)))
+    {
+        kfree(setpoints);
+        return -EFAULT;
+    }
+
+    mutex_lock(&ctl_lock);
+    for (i = 0; i < values.count; i++)
+    {
+        if (setpoints[i].idx >= n_servos)
+        {
+            success = -EINVAL;
+        }
+        else if (write && !test_bit(setpoints[i].idx, client->owned))
+        {
+            success = -EACCES;
+        }
+    }
+    for (i = 0; i < values.count && !success; i++)
+    {
+        if (write)
+        {
+            servo_set_period(&(servos[setpoints[i].idx]), servo_clamp_period(&(servos[setpoints[i].idx]), setpoints[i].period_ns), SETPOINT_IOCTL);
+        }
+        else
+        {
+            setpoints[i].period_ns = atomic_read(&(servos[setpoints[i].idx].hot->period_ns));
+        }
+    }
+    mutex_unlock(&ctl_lock);
+
+    if (!success && !write && copy_to_user(u64_to_user_ptr(values.setpoints), setpoints, values.count*sizeof(struct servo_setpoint)))
+    {
+        success = -EFAULT;
     }
 
+    kfree(setpoints);
     return success;
 }
@@ -0,0 +1,86 @@
+/*
+ * servo_trace.h
+ *
+ * Author: LikeSmith
+ * Date: March 2023
+ *
+ * Tracepoints for the servo driver, usable from ftrace, perf and bpftrace.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM servo
+
+#if !defined(_SERVO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SERVO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// An output edge, with the time it was due and the time it was driven
+TRACE_EVENT(servo_edge,
+    TP_PROTO(unsigned int idx, int active, s64 expires_ns, s64 actual_ns),
+    TP_ARGS(idx, active, expires_ns, actual_ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, idx)
+        __field(int, active)
+        __field(s64, expires_ns)
+        __field(s64, actual_ns)
+    ),
+    TP_fast_assign(
+        __entry->idx = idx;
+        __entry->active = active;
+        __entry->expires_ns = expires_ns;
+        __entry->actual_ns = actual_ns;
+    ),
+    TP_printk("servo=%u edge=%s expires=%lld actual=%lld late=%lld",
+        __entry->idx, __entry->active ? "rise" : "fall",
+        __entry->expires_ns, __entry->actual_ns,
+        __entry->actual_ns - __entry->expires_ns)
+);
+
+// A new period taking effect, source matches the SETPOINT_* values in servo.c
+TRACE_EVENT(servo_setpoint,
+    TP_PROTO(unsigned int idx, unsigned int period_ns, int source),
+    TP_ARGS(idx, period_ns, source),
+    TP_STRUCT__entry(
+        __field(unsigned int, idx)
+        __field(unsigned int, period_ns)
+        __field(int, source)
+    ),
+    TP_fast_assign(
+        __entry->idx = idx;
+        __entry->period_ns = period_ns;
+        __entry->source = source;
+    ),
+    TP_printk("servo=%u period=%u source=%s",
+        __entry->idx, __entry->period_ns,
+        __print_symbolic(__entry->source,
+            {0, "write"}, {1, "ioctl"}, {2, "shm"}, {3, "commit"}, {4, "trajectory"}))
+);
+
+// An ioctl on a servo file and its result
+TRACE_EVENT(servo_ioctl,
+    TP_PROTO(unsigned int idx, unsigned int cmd, unsigned long arg, long ret),
+    TP_ARGS(idx, cmd, arg, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, idx)
+        __field(unsigned int, cmd)
+        __field(unsigned long, arg)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->idx = idx;
+        __entry->cmd = cmd;
+        __entry->arg = arg;
+        __entry->ret = ret;
+    ),
+    TP_printk("servo=%u cmd=0x%x nr=%u arg=0x%lx ret=%ld",
+        __entry->idx, __entry->cmd, _IOC_NR(__entry->cmd), __entry->arg, __entry->ret)
+);
+
+#endif /* _SERVO_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE servo_trace
+#include <trace/define_trace.h>
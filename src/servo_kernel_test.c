@@ -24,6 +24,19 @@
 #define SERVO_RF  _IOR('s',4,uint32_t*) // Read flags
 #define SERVO_WV  _IOW('s',5,uint32_t*) // Write Value
 #define SERVO_RV  _IOW('s',6,uint32_t*) // Read Value
+#define SERVO_RL  _IOR('s',9,struct servo_lateness) // Read lateness
+
+// Timer lateness, how long after the programmed expiry callbacks ran
+struct servo_lateness
+{
+    uint32_t last_ns;
+    uint32_t max_ns;
+    uint64_t total_ns;
+    uint64_t count;
+    uint64_t spin_ns;       // time spent busy-waiting for exact edges
+    uint32_t margin_ns;     // current early-fire margin
+    uint32_t cpu;           // cpu the last callback ran on, -1 before the first
+};
 
 // Settings
 #define SERVO_DEV "/dev/servo0"
@@ -35,6 +48,7 @@ int main(int argc, char **argv)
     int fd;
     float val;
     uint32_t pulse_ns;
+    struct servo_lateness lat;
 
     printf("Servo Kernel Test...\n");
     printf("Opening servo device...\n");
@@ -82,6 +96,19 @@ int main(int argc, char **argv)
     }
 
 exit:
+    if (ioctl(fd, SERVO_RL, &lat))
+    {
+        printf("Could not read servo lateness.\n");
+    }
+    else if (lat.count > 0)
+    {
+        printf("Timer lateness: mean %lluns, max %uns over %llu callbacks, last on cpu %d\n", (unsigned long long)(lat.total_ns / lat.count), lat.max_ns, (unsigned long long)lat.count, (int32_t)lat.cpu);
+        if (lat.spin_ns > 0)
+        {
+            printf("Precision mode: %lluns spent spinning, early-fire margin %uns\n", (unsigned long long)lat.spin_ns, lat.margin_ns);
+        }
+    }
+
     if (ioctl(fd, SERVO_DIS, NULL))
     {
         printf("Could not disable servo.");